@@ -4,6 +4,18 @@
 
 #include <random>
 #include <iostream>
+#include <limits>
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include <mutex>
+#include <sstream>
+#include <cstring>
+#include <cmath>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 std::minstd_rand rand_engine; // Reasonably quick pseudo-random generator
 
@@ -18,6 +30,337 @@ Type random_in_range(Type start, Type end)
     return static_cast<Type>(start+num);
 }
 
+// Merges that share the work between threads. Ranges shorter than 'threshold' and calls
+// with fewer than two threads use the standard algorithms in the calling thread.
+
+// Merges sorted runs [first1, last1) and [first2, last2) to 'out'. The longer run is cut in
+// the middle and the cut is found from the other run with binary search, so both halves can
+// be merged at the same time. Equal elements of the first run stay first.
+template <typename Iterator, typename Out, typename Less>
+void parallel_merge(Iterator first1, Iterator last1, Iterator first2, Iterator last2, Out out,
+                    Less less, unsigned int threads, std::size_t threshold)
+{
+    std::size_t length1 = last1 - first1;
+    std::size_t length2 = last2 - first2;
+    if(threads < 2 || length1 + length2 < threshold){
+        std::merge(first1, last1, first2, last2, out, less);
+        return;
+    }
+
+    Iterator middle1;
+    Iterator middle2;
+    if(length1 >= length2){
+        middle1 = first1 + length1 / 2;
+        middle2 = std::lower_bound(first2, last2, *middle1, less);
+    } else{
+        middle2 = first2 + length2 / 2;
+        middle1 = std::upper_bound(first1, last1, *middle2, less);
+    }
+    Out middleOut = out + ((middle1 - first1) + (middle2 - first2));
+
+    std::thread left([=](){
+        parallel_merge(first1, middle1, first2, middle2, out, less, threads / 2, threshold);
+    });
+    parallel_merge(middle1, last1, middle2, last2, middleOut, less, threads - threads / 2, threshold);
+    left.join();
+}
+
+// Like std::inplace_merge, but merges to a buffer with parallel_merge and moves the result back.
+template <typename Iterator, typename Less>
+void parallel_inplace_merge(Iterator first, Iterator middle, Iterator last, Less less,
+                            unsigned int threads, std::size_t threshold)
+{
+    if(threads < 2 || std::size_t(last - first) < threshold){
+        std::inplace_merge(first, middle, last, less);
+        return;
+    }
+    std::vector<typename std::iterator_traits<Iterator>::value_type> buffer(last - first);
+    parallel_merge(first, middle, middle, last, buffer.begin(), less, threads, threshold);
+    std::move(buffer.begin(), buffer.end(), first);
+}
+
+// Radix sort for distance orders. A distance and a handle are packed to one 64-bit key whose
+// unsigned order is the order by distance and then by handle, so ties are broken the same way
+// every time and a sort is a few linear passes over contiguous memory.
+
+// Shorter arrays are sorted with std::stable_sort, which is faster for them than counting.
+std::size_t const RADIX_SORT_THRESHOLD = 256;
+
+std::uint64_t distance_key(int distance, std::uint32_t handle)
+{
+    return (std::uint64_t(std::uint32_t(distance) ^ 0x80000000u) << 32) | handle;
+}
+
+std::uint32_t key_handle(std::uint64_t key)
+{
+    return std::uint32_t(key);
+}
+
+// Order of TownsByDistance. Same as the order of distance keys, so every town has one place in it.
+bool distance_less(TownData* a, TownData* b)
+{
+    return distance_key(a->TownDistance, a->slot) < distance_key(b->TownDistance, b->slot);
+}
+
+// LSD radix sort with 8-bit digits by a 64-bit key of every entry. Counts of all digits are
+// taken in one pass first and digits that are the same in every key are skipped, so the bytes
+// that small distances and handles leave at zero cost nothing. Entries with equal keys keep
+// their order.
+template <typename Entry, typename Key>
+void radix_sort(std::vector<Entry>& entries, Key key)
+{
+    std::size_t const length = entries.size();
+    if(length < RADIX_SORT_THRESHOLD){
+        std::stable_sort(entries.begin(), entries.end(), [&key](Entry const& a, Entry const& b){
+            return key(a) < key(b);
+        });
+        return;
+    }
+
+    std::array<std::array<std::size_t, 256>, 8> counts = {};
+    for(Entry const& entry : entries){
+        std::uint64_t value = key(entry);
+        for(unsigned int digit = 0; digit < 8; ++digit){
+            ++counts[digit][(value >> (8 * digit)) & 0xff];
+        }
+    }
+
+    std::vector<Entry> buffer(length);
+    for(unsigned int digit = 0; digit < 8; ++digit){
+        std::array<std::size_t, 256>& positions = counts[digit];
+        if(positions[(key(entries[0]) >> (8 * digit)) & 0xff] == length){
+            continue;
+        }
+        std::size_t position = 0;
+        for(std::size_t& count : positions){
+            std::size_t next = position + count;
+            count = position;
+            position = next;
+        }
+        for(Entry const& entry : entries){
+            buffer[positions[(key(entry) >> (8 * digit)) & 0xff]++] = entry;
+        }
+        entries.swap(buffer);
+    }
+}
+
+void radix_sort(std::vector<std::uint64_t>& keys)
+{
+    radix_sort(keys, [](std::uint64_t key){
+        return key;
+    });
+}
+
+// String sort for alphabetical orders. Every entry caches 8 bytes of its name as a big-endian
+// number, so comparing the numbers compares the bytes like std::string does and the entries
+// are sorted by them with the radix sort above without touching the names. Only entries whose
+// 8 bytes tie read the next 8 bytes of their names and are sorted again by them, and so on.
+
+struct NameEntry
+{
+    std::uint64_t prefix;
+    std::uint32_t town;
+};
+
+// Bytes depth..depth+7 of name, with zeros after its end.
+std::uint64_t name_prefix(std::string const& name, std::size_t depth)
+{
+    std::uint64_t prefix = 0;
+    for(std::size_t i = depth; i < depth + 8; ++i){
+        prefix = (prefix << 8) | (i < name.size() ? static_cast<unsigned char>(name[i]) : 0);
+    }
+    return prefix;
+}
+
+// Entries in [first, last) have the same first 'depth' bytes and are sorted by their prefixes
+// of the next 8 bytes. Sorts every group of tied prefixes further and gives the group its
+// prefix back afterwards, so entries end up with the prefixes they came with.
+template <typename Iterator, typename Name>
+void sort_prefix_ties(Iterator first, Iterator last, std::size_t depth, Name name)
+{
+    while(first != last){
+        Iterator tie = first + 1;
+        bool longer = name(first->town).size() > depth + 8;
+        while(tie != last && tie->prefix == first->prefix){
+            longer = longer || name(tie->town).size() > depth + 8;
+            ++tie;
+        }
+        if(tie - first > 1){
+            auto prefix_less = [](NameEntry const& a, NameEntry const& b){
+                return a.prefix < b.prefix;
+            };
+            if(longer){
+                std::uint64_t shared = first->prefix;
+                for(Iterator entry = first; entry != tie; ++entry){
+                    entry->prefix = name_prefix(name(entry->town), depth + 8);
+                }
+                std::sort(first, tie, prefix_less);
+                sort_prefix_ties(first, tie, depth + 8, name);
+                for(Iterator entry = first; entry != tie; ++entry){
+                    entry->prefix = shared;
+                }
+            }
+            else{
+                // Names end inside these 8 bytes, so they differ at most by zeros at their ends.
+                std::sort(first, tie, [&name](NameEntry const& a, NameEntry const& b){
+                    return name(a.town).size() < name(b.town).size();
+                });
+            }
+        }
+        first = tie;
+    }
+}
+
+// Sorts towns by the names that name(town) returns.
+template <typename Name>
+void sort_by_name(std::vector<NameEntry>& entries, Name name)
+{
+    for(NameEntry& entry : entries){
+        entry.prefix = name_prefix(name(entry.town), 0);
+    }
+    radix_sort(entries, [](NameEntry const& entry){
+        return entry.prefix;
+    });
+    sort_prefix_ties(entries.begin(), entries.end(), 0, name);
+}
+
+// Minimum run length of TownSorter for 'length' towns. Between 32 and 64 and chosen so that
+// length / minimum run is a power of two or a little less, which keeps the merges balanced.
+std::size_t minimum_run(std::size_t length)
+{
+    std::size_t odd = 0;
+    while(length >= 64){
+        odd |= length & 1;
+        length >>= 1;
+    }
+    return length + odd;
+}
+
+template <typename Less>
+void TownSorter::sort(Iterator first, Iterator last, Less less)
+{
+    std::size_t length = last - first;
+    if(length < 2){
+        return;
+    }
+    std::size_t minimumRun = minimum_run(length);
+    runs.clear();
+
+    Iterator start = first;
+    while(start != last){
+        Iterator end = start + 1;
+        if(end != last && less(*end, *start)){
+            // Only strictly descending runs are reversed, so equal towns keep their order.
+            while(end != last && less(*end, *(end - 1))){
+                ++end;
+            }
+            std::reverse(start, end);
+        }
+        else{
+            while(end != last && !less(*end, *(end - 1))){
+                ++end;
+            }
+        }
+
+        std::size_t forced = std::min<std::size_t>(minimumRun, last - start);
+        if(std::size_t(end - start) < forced){
+            insertion_sort(start, end, start + forced, less);
+            end = start + forced;
+        }
+        runs.push_back({start, std::size_t(end - start)});
+        merge_runs(false, less);
+        start = end;
+    }
+    merge_runs(true, less);
+}
+
+template <typename Less>
+void TownSorter::merge(Iterator first, Iterator middle, Iterator last, Less less)
+{
+    if(first == middle || middle == last){
+        return;
+    }
+    first = std::upper_bound(first, middle, *middle, less);
+    if(first == middle){
+        return;
+    }
+    last = std::lower_bound(middle, last, *(middle - 1), less);
+
+    // The shorter range is copied to the scratch buffer and merged from the end it is at.
+    if(middle - first <= last - middle){
+        scratch.assign(first, middle);
+        auto left = scratch.begin();
+        Iterator right = middle;
+        Iterator out = first;
+        while(left != scratch.end() && right != last){
+            if(less(*right, *left)){
+                *out++ = *right++;
+            }
+            else{
+                *out++ = *left++;
+            }
+        }
+        std::copy(left, scratch.end(), out);
+    }
+    else{
+        scratch.assign(middle, last);
+        Iterator left = middle;
+        auto right = scratch.end();
+        Iterator out = last;
+        while(left != first && right != scratch.begin()){
+            if(less(*(right - 1), *(left - 1))){
+                *--out = *--left;
+            }
+            else{
+                *--out = *--right;
+            }
+        }
+        std::copy_backward(scratch.begin(), right, out);
+    }
+}
+
+template <typename Less>
+void TownSorter::insertion_sort(Iterator first, Iterator sortedUntil, Iterator last, Less less)
+{
+    for(Iterator next = sortedUntil; next != last; ++next){
+        TownData* town = *next;
+        Iterator position = std::upper_bound(first, next, town, less);
+        std::move_backward(position, next, next + 1);
+        *position = town;
+    }
+}
+
+template <typename Less>
+void TownSorter::merge_runs(bool all, Less less)
+{
+    while(runs.size() > 1){
+        std::size_t i = runs.size() - 2;
+        if(all){
+            if(i > 0 && runs[i - 1].length < runs[i + 1].length){
+                --i;
+            }
+        }
+        else if((i > 0 && runs[i - 1].length <= runs[i].length + runs[i + 1].length)
+                || (i > 1 && runs[i - 2].length <= runs[i - 1].length + runs[i].length)){
+            if(runs[i - 1].length < runs[i + 1].length){
+                --i;
+            }
+        }
+        else if(runs[i].length > runs[i + 1].length){
+            return;
+        }
+        merge_at(i, less);
+    }
+}
+
+template <typename Less>
+void TownSorter::merge_at(std::size_t i, Less less)
+{
+    Iterator middle = runs[i + 1].first;
+    merge(runs[i].first, middle, middle + runs[i + 1].length, less);
+    runs[i].length += runs[i + 1].length;
+    runs.erase(runs.begin() + i + 1);
+}
 
 
 Datastructures::Datastructures()
@@ -25,6 +368,10 @@ Datastructures::Datastructures()
     TownCount = 0;
     addedItemsToAlpha = 0;
     addedItemsToDist = 0;
+    removedTowns = 0;
+    published = std::make_shared<TownSnapshot const>();
+    mergeThreads = 0;
+    mergeThreshold = PARALLEL_MERGE_THRESHOLD;
 }
 
 Datastructures::~Datastructures()
@@ -34,79 +381,114 @@ Datastructures::~Datastructures()
 
 unsigned int Datastructures::size()
 {
+    STATS_TIMER("size");
     return TownCount; // Replace with actual implementation
 }
 
 void Datastructures::clear()
 {
-    for(; TownCount > 0; TownCount--){
-        delete TownsByAlphabets.back();
-        TownsByAlphabets.pop_back();
-        TownsByDistance.pop_back();
-    }
+    STATS_TIMER("clear");
+    TownsByAlphabets.clear();
+    TownsByDistance.clear();
+    liveTowns.clear();
+    livePositions.clear();
+    distanceCounts.clear();
+    distanceHeap.clear();
+    pool.clear();
+    Columns.clear();
+    TownCount = 0;
     addedItemsToAlpha = 0;
     addedItemsToDist = 0;
+    removedTowns = 0;
 }
 
-std::vector<TownData*> Datastructures::all_towns()
+std::vector<TownData*> const& Datastructures::all_towns()
 {
-    return TownsByAlphabets;
+    STATS_TIMER("all_towns");
+    return liveTowns;
 }
 
 TownData* Datastructures::add_town(const std::string& name, int x, int y)
 {
-    TownData* town = new TownData{name, x, y, std::abs(x) + std::abs(y)};
+    STATS_TIMER("add_town");
+    TownData* town = pool.create(name, x, y);
+    Columns.set(town->slot, x, y);
+    Columns.count_distances(town->slot, town->slot + 1);
+    town->TownDistance = Columns.distance[town->slot];
     TownsByAlphabets.push_back(town);
     TownsByDistance.push_back(town);
+    add_live(town);
+    distanceHeap.insert(town->TownDistance, town->slot);
     ++TownCount;
     ++addedItemsToAlpha;
     ++addedItemsToDist;
     return town;
 }
 
-std::vector<TownData*> Datastructures::towns_alphabetically()
+std::vector<TownData*> Datastructures::add_towns(const std::vector<TownRecord>& towns)
 {
-    if(addedItemsToAlpha == 0){
-        return TownsByAlphabets;
+    STATS_TIMER("add_towns");
+    std::vector<TownData*> added;
+    added.reserve(towns.size());
+    TownsByAlphabets.reserve(TownsByAlphabets.size() + towns.size());
+    TownsByDistance.reserve(TownsByDistance.size() + towns.size());
+    Columns.reserve(TownCount + towns.size());
+    liveTowns.reserve(TownCount + towns.size());
+    distanceHeap.reserve(TownCount + towns.size());
+
+    unsigned int first = std::numeric_limits<unsigned int>::max();
+    unsigned int last = 0;
+    for(TownRecord const& record : towns){
+        TownData* town = pool.create(record.name, record.x, record.y);
+        Columns.set(town->slot, record.x, record.y);
+        first = std::min(first, town->slot);
+        last = std::max(last, town->slot + 1);
+        added.push_back(town);
     }
-    else {
-        int townIndex = TownCount - addedItemsToAlpha;
-        if(townIndex == 0){
-            mergeSort(TownsByAlphabets, 0, TownCount-1, &Datastructures::alphabetical);
-        }
-        else{
-            mergeSort(TownsByAlphabets, townIndex, TownCount-1, &Datastructures::alphabetical);
-            merge(TownsByAlphabets, 0, townIndex-1, TownCount-1, &Datastructures::alphabetical);
-        }
+    if(added.empty()){
+        return added;
     }
-    addedItemsToAlpha = 0;
+
+    Columns.count_distances(first, last);
+    for(TownData* town : added){
+        town->TownDistance = Columns.distance[town->slot];
+        TownsByAlphabets.push_back(town);
+        TownsByDistance.push_back(town);
+        add_live(town);
+        distanceHeap.insert(town->TownDistance, town->slot);
+    }
+    TownCount += added.size();
+    addedItemsToAlpha += added.size();
+    addedItemsToDist += added.size();
+
+    sort_towns_by_alphabets();
+    sort_towns_by_distance();
+
+    return added;
+}
+
+std::vector<TownData*> const& Datastructures::towns_alphabetically()
+{
+    STATS_TIMER("towns_alphabetically");
+    compact();
+    sort_towns_by_alphabets();
     return TownsByAlphabets;
 }
 
-std::vector<TownData*> Datastructures::towns_distance_increasing()
+std::vector<TownData*> const& Datastructures::towns_distance_increasing()
 {
-    if(addedItemsToDist == 0){
-        return TownsByDistance;
-    }
-    else {
-        int townIndex = TownCount - addedItemsToDist;
-        if(townIndex == 0){
-            mergeSort(TownsByDistance, 0, TownCount-1, &Datastructures::byDistance);
-        }
-        else{
-            mergeSort(TownsByDistance, townIndex, TownCount-1, &Datastructures::byDistance);
-            merge(TownsByDistance, 0, townIndex-1, TownCount-1, &Datastructures::byDistance);
-        }
-    }
-    addedItemsToDist = 0;
+    STATS_TIMER("towns_distance_increasing");
+    compact();
+    sort_towns_by_distance();
     return TownsByDistance;
 }
 
 
 TownData* Datastructures::find_town(std::string const& name)
 {
+    STATS_TIMER("find_town");
     sort_towns_by_alphabets();
-    int result = alphabetBinarySearch(TownsByAlphabets, 0, TownCount - 1, name);
+    int result = alphabetBinarySearch(TownsByAlphabets, 0, TownsByAlphabets.size() - 1, name);
     if(result == -1){
         return nullptr;
     }
@@ -115,213 +497,890 @@ TownData* Datastructures::find_town(std::string const& name)
 
 TownData* Datastructures::min_distance()
 {
-    if(!TownsByAlphabets.empty()){
-        if(addedItemsToDist == 0){
-            return TownsByDistance[0];
-        }
-
-        sort_towns_by_distance();
-
-        return TownsByDistance[0];
+    STATS_TIMER("min_distance");
+    if(TownCount == 0){
+        return nullptr;
     }
-    return nullptr;
+    return pool.at(distanceHeap.min_slot());
 }
 
 TownData* Datastructures::max_distance()
 {
-    if(!TownsByDistance.empty()){
-        if(addedItemsToDist == 0){
-            return TownsByDistance[TownCount-1];
-        }
-
-        sort_towns_by_distance();
-
-        return TownsByDistance[TownCount-1];
+    STATS_TIMER("max_distance");
+    if(TownCount == 0){
+        return nullptr;
     }
-    return nullptr;
+    return pool.at(distanceHeap.max_slot());
 }
 
 TownData* Datastructures::nth_distance(unsigned int n)
 {
-    if(n == 0 || n > TownCount){
+    STATS_TIMER("nth_distance");
+    if(n == 0 || n > unsigned(TownCount)){
         return nullptr;
     }
 
     sort_towns_by_distance();
+    if(!distanceCounts.built()){
+        std::vector<unsigned char> live(TownsByDistance.size());
+        for(std::size_t i = 0; i < TownsByDistance.size(); ++i){
+            live[i] = !is_removed(TownsByDistance[i]);
+        }
+        distanceCounts.build(live);
+        STATS_ADD(liveCountBuilds, 1);
+    }
 
-    return TownsByDistance[n - 1];
+    return TownsByDistance[distanceCounts.find(n - 1)];
 }
 
 void Datastructures::remove_town(const std::string& town_name)
 {
+    STATS_TIMER("remove_town");
     sort_towns_by_alphabets();
-    int result = alphabetBinarySearch(TownsByAlphabets, 0, TownCount - 1, town_name);
+    int result = alphabetBinarySearch(TownsByAlphabets, 0, TownsByAlphabets.size() - 1, town_name);
 
     if(result == -1){
         return;
     }
 
-    TownsByAlphabets.erase(TownsByAlphabets.begin() + result);
+    // The town stays in both vectors with its name and distance, so they stay sorted and it can be
+    // stepped over. It is taken out and its record released when removed towns are the majority.
+    TownData* town = TownsByAlphabets[result];
+    unsigned int slot = town->slot;
+    if(distanceCounts.built()){
+        // Towns added after the counts were built are not in them yet.
+        auto sortedUntil = TownsByDistance.end() - addedItemsToDist;
+        auto position = std::lower_bound(TownsByDistance.begin(), sortedUntil, town, distance_less);
+        if(position != sortedUntil && *position == town){
+            distanceCounts.erase(position - TownsByDistance.begin());
+        }
+    }
+    Columns.used[slot] = 0;
+    remove_live(slot);
+    distanceHeap.erase(slot);
     --TownCount;
-    TownsByDistance.pop_back();
-
-    for(int i = 0; i < TownCount; i++){
-        TownsByDistance[i] = TownsByAlphabets[i];
+    ++removedTowns;
+    if(removedTowns > TownCount){
+        compact();
     }
-
-    addedItemsToDist = TownCount;
 }
 
-std::vector<TownData*> Datastructures::towns_distance_increasing_from(int x, int y)
+std::vector<TownData*> Datastructures::towns_distance_increasing_from(int x, int y) const
 {
-    std::vector<TownData*> temp;
-    temp.reserve(TownCount);
-    int dist;
-    for(int i = 0; i < TownCount; i++){
-        dist = std::abs(TownsByDistance[i]->x - x) + std::abs(TownsByDistance[i]->y - y);
-        temp.push_back(TownsByDistance[i]);
-        temp[i]->TownDistance = dist;
-    }
-
-    mergeSort(temp, 0, TownCount-1, &Datastructures::byDistance);
-
-    return temp;
+    STATS_TIMER("towns_distance_increasing_from");
+    std::vector<std::uint64_t> order = distances_from(x, y);
+    radix_sort(order);
+    return towns_of(order.begin(), order.end());
 }
 
-void Datastructures::merge(std::vector<TownData*> &aVector, int left, int middle, int right,
-                           bool (Datastructures::*compare)
-                           (std::vector<TownData*> &left, std::vector<TownData*> &right, int i, int j))
+std::vector<TownData*> Datastructures::nearest_towns(int x, int y, unsigned int k) const
 {
+    STATS_TIMER("nearest_towns");
+    std::vector<std::uint64_t> order = distances_from(x, y);
 
-    int i, j, k;
-    int n1 = middle - left + 1;
-    int n2 = right - middle;
+    auto last = order.begin() + std::min<std::size_t>(k, order.size());
+    std::nth_element(order.begin(), last, order.end());
+    std::sort(order.begin(), last);
 
-    std::vector<TownData*> L;
-    std::vector<TownData*> R;
+    return towns_of(order.begin(), last);
+}
 
-    L.reserve(n1);
-    R.reserve(n2);
+void Datastructures::publish_snapshot()
+{
+    STATS_TIMER("publish_snapshot");
+    compact();
+    sort_towns_by_alphabets();
+    auto next = std::make_shared<TownSnapshot>();
+    next->towns.reserve(TownCount);
+    next->x.reserve(TownCount);
+    next->y.reserve(TownCount);
+    for(TownData* town : TownsByAlphabets){
+        unsigned int position = next->towns.size();
+        next->towns.push_back({town->name, town->x, town->y, town->TownDistance, position});
+        next->x.push_back(town->x);
+        next->y.push_back(town->y);
+    }
 
-    for(i = 0; i < n1; i++){
-        L[i] = aVector[left+i];
+    next->alphabetical.reserve(TownCount);
+    for(TownData const& town : next->towns){
+        next->alphabetical.push_back(&town);
     }
-    for(j = 0; j < n2; j++){
-        R[j] = aVector[middle+j+1];
+    // Ties in distance are broken by position, which keeps them in alphabetical order.
+    std::vector<std::uint64_t> order;
+    order.reserve(TownCount);
+    for(TownData const& town : next->towns){
+        order.push_back(distance_key(town.TownDistance, town.slot));
     }
-
-    i = 0;
-    j = 0;
-    k = left;
-
-    while (i < n1 && j < n2){
-        if((this->*compare)(L, R, i, j)){     //(this->*compare)(temp, i, j))//{(L[i]->name <= R[j]->name){
-            aVector[k] = L[i];
-            i++;
-        }
-        else {
-            aVector[k] = R[j];
-            j++;
-        }
-        k++;
+    radix_sort(order);
+    next->byDistance.reserve(TownCount);
+    for(std::uint64_t key : order){
+        next->byDistance.push_back(&next->towns[key_handle(key)]);
     }
 
-    while (i < n1)
-    {
-        aVector[k] = L[i];
-        i++;
-        k++;
-    }
+    std::atomic_store(&published, std::shared_ptr<TownSnapshot const>(std::move(next)));
+}
 
-    while (j < n2)
-    {
-        aVector[k] = R[j];
-        j++;
-        k++;
-    }
+std::shared_ptr<TownSnapshot const> Datastructures::snapshot() const
+{
+    return std::atomic_load(&published);
 }
 
-void Datastructures::mergeSort(std::vector<TownData*> &aVector, int left, int right,
-                               bool (Datastructures::*compare)
-                               (std::vector<TownData*> &left, std::vector<TownData*> &right, int i, int j))
+void Datastructures::set_merge_threads(unsigned int threads, std::size_t threshold)
 {
-    if (left < right){
-        int middle = left+(right-left) / 2;
-        mergeSort(aVector, left, middle, compare);
-        mergeSort(aVector, middle+1, right, compare);
-        merge(aVector, left, middle, right, compare);
+    mergeThreads = threads;
+    mergeThreshold = threshold;
+}
+
+unsigned int Datastructures::merge_thread_count() const
+{
+    if(mergeThreads == 0){
+        return std::max(1u, std::thread::hardware_concurrency());
     }
+    return mergeThreads;
 }
 
-// Called if merge sort is done with alphabets.
-bool Datastructures::alphabetical(std::vector<TownData*> &left, std::vector<TownData*> &right, int i, int j)
+std::string Datastructures::dump_stats() const
 {
-    return (left[i]->name <= right[j]->name);
+#ifdef DATASTRUCTURES_STATS
+    return stats.dump();
+#else
+    return "";
+#endif
 }
 
-// Called if merge sort is done with distances.
-bool Datastructures::byDistance(std::vector<TownData*> &left, std::vector<TownData*> &right, int i, int j)
+void Datastructures::reset_stats()
 {
-    return (left[i]->TownDistance <= right[j]->TownDistance);
+#ifdef DATASTRUCTURES_STATS
+    stats.reset();
+#endif
 }
 
-// Normal binary search done with alphabets.
-int Datastructures::alphabetBinarySearch(std::vector<TownData*> &aVector, int left, int right, std::string x)
+// Binary search done with alphabets. Finds the first town with the name and steps over removed ones.
+int Datastructures::alphabetBinarySearch(std::vector<TownData*> &aVector, int left, int right, std::string const& x)
 {
-    while(left<=right)
+    ++right;
+    while(left < right)
     {
         int middle = left + (right-left) / 2;
 
-        if(aVector[middle]->name == x)
-            return middle;
-
         if(aVector[middle]->name < x)
             left = middle + 1;
         else
-            right = middle -1;
+            right = middle;
+    }
+
+    while(left < int(aVector.size()) && aVector[left]->name == x){
+        if(!is_removed(aVector[left]))
+            return left;
+        ++left;
     }
 
     return -1;
 }
 
+bool Datastructures::is_removed(TownData* town) const
+{
+    return !Columns.used[town->slot];
+}
+
+void Datastructures::add_live(TownData* town)
+{
+    if(town->slot >= livePositions.size()){
+        livePositions.resize(town->slot + 1);
+    }
+    livePositions[town->slot] = liveTowns.size();
+    liveTowns.push_back(town);
+}
+
+void Datastructures::remove_live(unsigned int slot)
+{
+    TownData* last = liveTowns.back();
+    liveTowns[livePositions[slot]] = last;
+    livePositions[last->slot] = livePositions[slot];
+    liveTowns.pop_back();
+}
+
+// Takes removed towns out of both vectors and releases their records. Both vectors keep their order
+// and the unsorted ends shrink by the removed towns that were in them.
+void Datastructures::compact()
+{
+    if(removedTowns == 0){
+        return;
+    }
+
+    auto compact_vector = [this](std::vector<TownData*>& towns, int& unsorted){
+        std::size_t sortedUntil = towns.size() - unsorted;
+        std::size_t kept = 0;
+        for(std::size_t i = 0; i < towns.size(); ++i){
+            if(!is_removed(towns[i])){
+                towns[kept++] = towns[i];
+            }
+            else if(i >= sortedUntil){
+                --unsorted;
+            }
+        }
+        towns.resize(kept);
+    };
+
+    for(TownData* town : TownsByAlphabets){
+        if(is_removed(town)){
+            pool.release(town);
+        }
+    }
+    compact_vector(TownsByAlphabets, addedItemsToAlpha);
+    compact_vector(TownsByDistance, addedItemsToDist);
+    distanceCounts.clear();
+
+    STATS_ADD(compactions, 1);
+    STATS_ADD(compactedTowns, removedTowns);
+    removedTowns = 0;
+}
+
+// Keys of distance from (x, y) and slot for every town. Ties in distance are ordered by slot.
+std::vector<std::uint64_t> Datastructures::distances_from(int x, int y) const
+{
+    std::size_t slots = Columns.x.size();
+    std::vector<int> distances(slots);
+    manhattan_distances(Columns.x.data(), Columns.y.data(), slots, x, y, distances.data());
+
+    std::vector<std::uint64_t> order;
+    order.reserve(TownCount);
+    for(unsigned int slot = 0; slot < slots; slot++){
+        if(Columns.used[slot]){
+            order.push_back(distance_key(distances[slot], slot));
+        }
+    }
+    return order;
+}
+
+std::vector<TownData*> Datastructures::towns_of(std::vector<std::uint64_t>::const_iterator first,
+                                                std::vector<std::uint64_t>::const_iterator last) const
+{
+    std::vector<TownData*> towns;
+    towns.reserve(last - first);
+    for(; first != last; ++first){
+        towns.push_back(pool.at(key_handle(*first)));
+    }
+    return towns;
+}
+
 // Does same as function towns_alphabetically() but doesn't return anything. Made just for sorting.
+// Big batches of new towns are merged with several threads.
 void Datastructures::sort_towns_by_alphabets()
 {
     if(addedItemsToAlpha == 0){
         return;
     }
+    unsigned int threads = merge_thread_count();
+    auto comparator = [](TownData* a, TownData* b){
+        return a->name < b->name;
+    };
+    auto sortedUntil = TownsByAlphabets.end() - addedItemsToAlpha;
+
+    // Few new towns are sorted with the sorter, which makes use of any order they already have.
+    // More are sorted by cached prefixes of their names.
+    if(std::size_t(addedItemsToAlpha) < RADIX_SORT_THRESHOLD){
+        sorter.sort(sortedUntil, TownsByAlphabets.end(), comparator);
+    }
     else {
-        int townIndex = TownCount - addedItemsToAlpha;
-        if(townIndex == 0){
-            mergeSort(TownsByAlphabets, 0, TownCount-1, &Datastructures::alphabetical);
-        }
-        else{
-            mergeSort(TownsByAlphabets, townIndex, TownCount-1, &Datastructures::alphabetical);
-            merge(TownsByAlphabets, 0, townIndex-1, TownCount-1, &Datastructures::alphabetical);
+        std::vector<NameEntry> entries;
+        entries.reserve(addedItemsToAlpha);
+        for(auto town = sortedUntil; town != TownsByAlphabets.end(); ++town){
+            entries.push_back({0, (*town)->slot});
         }
+        sort_by_name(entries, [this](std::uint32_t slot) -> std::string const& {
+            return pool.at(slot)->name;
+        });
+        std::transform(entries.begin(), entries.end(), sortedUntil, [this](NameEntry const& entry){
+            return pool.at(entry.town);
+        });
+    }
+
+    if(threads > 1 && std::size_t(addedItemsToAlpha) >= mergeThreshold){
+        parallel_inplace_merge(TownsByAlphabets.begin(), sortedUntil, TownsByAlphabets.end(), comparator, threads, mergeThreshold);
     }
+    else {
+        sorter.merge(TownsByAlphabets.begin(), sortedUntil, TownsByAlphabets.end(), comparator);
+    }
+    STATS_ADD(alphabeticalSorts, 1);
+    STATS_ADD(alphabeticalSortedElements, addedItemsToAlpha);
+    STATS_ADD(alphabeticalMergedElements, std::size_t(addedItemsToAlpha) == TownsByAlphabets.size() ? 0 : TownsByAlphabets.size());
     addedItemsToAlpha = 0;
     return;
 }
 
 // Does same as function towns_distance_increasing() but doesn't return anything. Made just for sorting.
+// Big batches of new towns are merged with several threads.
 void Datastructures::sort_towns_by_distance()
 {
     if(addedItemsToDist == 0){
         return;
     }
+    unsigned int threads = merge_thread_count();
+    auto comparator = distance_less;
+    auto sortedUntil = TownsByDistance.end() - addedItemsToDist;
+
+    // Few new towns are sorted with the sorter and more are radix sorted by distance and slot.
+    if(std::size_t(addedItemsToDist) < RADIX_SORT_THRESHOLD){
+        sorter.sort(sortedUntil, TownsByDistance.end(), comparator);
+    }
     else {
-        int townIndex = TownCount - addedItemsToDist;
-        if(townIndex == 0){
-            mergeSort(TownsByDistance, 0, TownCount-1, &Datastructures::byDistance);
-        }
-        else{
-            mergeSort(TownsByDistance, townIndex, TownCount-1, &Datastructures::byDistance);
-            merge(TownsByDistance, 0, townIndex-1, TownCount-1, &Datastructures::byDistance);
+        std::vector<std::uint64_t> order;
+        order.reserve(addedItemsToDist);
+        for(auto town = sortedUntil; town != TownsByDistance.end(); ++town){
+            order.push_back(distance_key((*town)->TownDistance, (*town)->slot));
         }
+        radix_sort(order);
+        std::transform(order.begin(), order.end(), sortedUntil, [this](std::uint64_t key){
+            return pool.at(key_handle(key));
+        });
     }
+
+    if(threads > 1 && std::size_t(addedItemsToDist) >= mergeThreshold){
+        parallel_inplace_merge(TownsByDistance.begin(), sortedUntil, TownsByDistance.end(), comparator, threads, mergeThreshold);
+    }
+    else {
+        sorter.merge(TownsByDistance.begin(), sortedUntil, TownsByDistance.end(), comparator);
+    }
+    STATS_ADD(distanceSorts, 1);
+    STATS_ADD(distanceSortedElements, addedItemsToDist);
+    STATS_ADD(distanceMergedElements, std::size_t(addedItemsToDist) == TownsByDistance.size() ? 0 : TownsByDistance.size());
     addedItemsToDist = 0;
+    distanceCounts.clear();
     return;
 }
 
+unsigned int TownSnapshot::size() const
+{
+    return towns.size();
+}
+
+std::vector<TownData const*> const& TownSnapshot::towns_alphabetically() const
+{
+    return alphabetical;
+}
+
+std::vector<TownData const*> const& TownSnapshot::towns_distance_increasing() const
+{
+    return byDistance;
+}
+
+TownData const* TownSnapshot::find_town(std::string const& name) const
+{
+    auto town = std::lower_bound(alphabetical.begin(), alphabetical.end(), name, [](TownData const* a, std::string const& name){
+        return a->name < name;
+    });
+    if(town == alphabetical.end() || (*town)->name != name){
+        return nullptr;
+    }
+    return *town;
+}
+
+TownData const* TownSnapshot::min_distance() const
+{
+    return nth_distance(1);
+}
+
+TownData const* TownSnapshot::max_distance() const
+{
+    return nth_distance(size());
+}
+
+TownData const* TownSnapshot::nth_distance(unsigned int n) const
+{
+    if(n == 0 || n > size()){
+        return nullptr;
+    }
+    return byDistance[n - 1];
+}
+
+std::vector<TownData const*> TownSnapshot::towns_distance_increasing_from(int fromX, int fromY) const
+{
+    std::vector<int> distances(size());
+    manhattan_distances(x.data(), y.data(), size(), fromX, fromY, distances.data());
+
+    std::vector<std::uint64_t> order;
+    order.reserve(size());
+    for(unsigned int town = 0; town < size(); town++){
+        order.push_back(distance_key(distances[town], town));
+    }
+    radix_sort(order);
+
+    std::vector<TownData const*> result;
+    result.reserve(size());
+    for(std::uint64_t key : order){
+        result.push_back(&towns[key_handle(key)]);
+    }
+    return result;
+}
+
+TownPool::TownPool()
+{
+    usedInLastChunk = CHUNK_SIZE;
+}
+
+TownData* TownPool::create(const std::string& name, int x, int y)
+{
+    TownData* town;
+    unsigned int slot;
+    if(!freeTowns.empty()){
+        town = freeTowns.back();
+        slot = town->slot;
+        freeTowns.pop_back();
+    } else {
+        if(usedInLastChunk == CHUNK_SIZE){
+            chunks.push_back(std::unique_ptr<TownData[]>(new TownData[CHUNK_SIZE]));
+            usedInLastChunk = 0;
+        }
+        town = &chunks.back()[usedInLastChunk];
+        slot = (chunks.size() - 1) * CHUNK_SIZE + usedInLastChunk;
+        ++usedInLastChunk;
+    }
+    *town = TownData{name, x, y, 0, slot};
+    return town;
+}
+
+void TownPool::release(TownData* town)
+{
+    town->name.clear();
+    freeTowns.push_back(town);
+}
+
+TownData* TownPool::at(unsigned int slot) const
+{
+    return &chunks[slot / CHUNK_SIZE][slot % CHUNK_SIZE];
+}
+
+void TownPool::clear()
+{
+    chunks.clear();
+    freeTowns.clear();
+    usedInLastChunk = CHUNK_SIZE;
+}
 
+void TownColumns::set(unsigned int slot, int x, int y)
+{
+    if(slot >= this->x.size()){
+        this->x.resize(slot + 1);
+        this->y.resize(slot + 1);
+        distance.resize(slot + 1);
+        used.resize(slot + 1);
+    }
+    this->x[slot] = x;
+    this->y[slot] = y;
+    used[slot] = 1;
+}
+
+void TownColumns::count_distances(unsigned int first, unsigned int last)
+{
+    manhattan_distances(x.data() + first, y.data() + first, last - first, 0, 0, distance.data() + first);
+}
+
+void TownColumns::reserve(std::size_t towns)
+{
+    x.reserve(towns);
+    y.reserve(towns);
+    distance.reserve(towns);
+    used.reserve(towns);
+}
+
+void TownColumns::clear()
+{
+    x.clear();
+    y.clear();
+    distance.clear();
+    used.clear();
+}
+
+void DistanceHeap::insert(int distance, unsigned int slot)
+{
+    if(slot >= positions.size()){
+        positions.resize(slot + 1);
+    }
+    keys.push_back(0);
+    place(keys.size() - 1, distance_key(distance, slot));
+    push_up(keys.size() - 1);
+}
+
+void DistanceHeap::erase(unsigned int slot)
+{
+    std::size_t position = positions[slot];
+    std::uint64_t last = keys.back();
+    keys.pop_back();
+    if(position == keys.size()){
+        return;
+    }
+    // Last key may belong above or below the hole. If it moves up, the key that comes down to
+    // the hole is pushed down from there.
+    place(position, last);
+    push_up(position);
+    push_down(position);
+}
+
+unsigned int DistanceHeap::min_slot() const
+{
+    return key_handle(keys[0]);
+}
+
+unsigned int DistanceHeap::max_slot() const
+{
+    std::size_t farthest = 0;
+    for(std::size_t child = 1; child <= 2 && child < keys.size(); ++child){
+        if(keys[child] > keys[farthest]){
+            farthest = child;
+        }
+    }
+    return key_handle(keys[farthest]);
+}
+
+bool DistanceHeap::empty() const
+{
+    return keys.empty();
+}
+
+void DistanceHeap::reserve(std::size_t towns)
+{
+    keys.reserve(towns);
+}
+
+void DistanceHeap::clear()
+{
+    keys.clear();
+    positions.clear();
+}
+
+void DistanceHeap::place(std::size_t position, std::uint64_t key)
+{
+    keys[position] = key;
+    positions[key_handle(key)] = position;
+}
+
+void DistanceHeap::swap_keys(std::size_t a, std::size_t b)
+{
+    std::uint64_t key = keys[a];
+    place(a, keys[b]);
+    place(b, key);
+}
+
+// Root is on level 0, which is a min level. Position p is on level floor(log2(p + 1)).
+bool DistanceHeap::on_max_level(std::size_t position)
+{
+    bool max = false;
+    for(std::size_t level = position + 1; level > 1; level /= 2){
+        max = !max;
+    }
+    return max;
+}
+
+void DistanceHeap::push_up(std::size_t position)
+{
+    if(position == 0){
+        return;
+    }
+    bool maxLevel = on_max_level(position);
+    std::size_t parent = (position - 1) / 2;
+    // Key that is on the wrong side of its parent belongs to the levels of the parent.
+    if(maxLevel ? keys[position] < keys[parent] : keys[position] > keys[parent]){
+        swap_keys(position, parent);
+        push_up_along(parent, !maxLevel);
+    } else {
+        push_up_along(position, maxLevel);
+    }
+}
+
+void DistanceHeap::push_up_along(std::size_t position, bool max)
+{
+    while(position > 2){
+        std::size_t grandparent = ((position - 1) / 2 - 1) / 2;
+        if(max ? keys[position] <= keys[grandparent] : keys[position] >= keys[grandparent]){
+            return;
+        }
+        swap_keys(position, grandparent);
+        position = grandparent;
+    }
+}
+
+void DistanceHeap::push_down(std::size_t position)
+{
+    bool max = on_max_level(position);
+    auto before = [max](std::uint64_t a, std::uint64_t b){
+        return max ? a > b : a < b;
+    };
+    while(2 * position + 1 < keys.size()){
+        // Smallest (or largest on max levels) of the children and grandchildren.
+        std::size_t best = 2 * position + 1;
+        for(std::size_t child = best; child <= 2 * position + 2 && child < keys.size(); ++child){
+            if(before(keys[child], keys[best])){
+                best = child;
+            }
+            for(std::size_t grandchild = 2 * child + 1; grandchild <= 2 * child + 2 && grandchild < keys.size(); ++grandchild){
+                if(before(keys[grandchild], keys[best])){
+                    best = grandchild;
+                }
+            }
+        }
+        if(!before(keys[best], keys[position])){
+            return;
+        }
+        swap_keys(position, best);
+        if(best <= 2 * position + 2){
+            return;
+        }
+        // Key that came down to a grandchild may have to change places with its parent on the other kind of level.
+        std::size_t parent = (best - 1) / 2;
+        if(before(keys[parent], keys[best])){
+            swap_keys(best, parent);
+        }
+        position = best;
+    }
+}
+
+void LiveCounts::build(std::vector<unsigned char> const& live)
+{
+    counts.assign(live.size() + 1, 0);
+    for(std::size_t i = 1; i <= live.size(); ++i){
+        counts[i] += live[i - 1] != 0;
+        std::size_t parent = i + (i & -i);
+        if(parent <= live.size()){
+            counts[parent] += counts[i];
+        }
+    }
+}
+
+void LiveCounts::erase(std::size_t position)
+{
+    for(std::size_t i = position + 1; i < counts.size(); i += i & -i){
+        --counts[i];
+    }
+}
+
+// Walks down from the biggest power of two and skips every range that has at most n live towns.
+std::size_t LiveCounts::find(std::size_t n) const
+{
+    std::size_t step = 1;
+    while(2 * step < counts.size()){
+        step *= 2;
+    }
+    std::size_t position = 0;
+    for(; step > 0; step /= 2){
+        if(position + step < counts.size() && counts[position + step] <= n){
+            position += step;
+            n -= counts[position];
+        }
+    }
+    return position;
+}
+
+bool LiveCounts::built() const
+{
+    return !counts.empty();
+}
+
+void LiveCounts::clear()
+{
+    counts.clear();
+}
+
+void manhattan_distances(int const* x, int const* y, std::size_t n, int fromX, int fromY, int* distances)
+{
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    __m256i const fromX8 = _mm256_set1_epi32(fromX);
+    __m256i const fromY8 = _mm256_set1_epi32(fromY);
+    for(; i + 8 <= n; i += 8){
+        __m256i dx = _mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(x + i)), fromX8);
+        __m256i dy = _mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(y + i)), fromY8);
+        __m256i sum = _mm256_add_epi32(_mm256_abs_epi32(dx), _mm256_abs_epi32(dy));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(distances + i), sum);
+    }
+#elif defined(__SSE2__)
+    // SSE2 has no absolute value for integers, so it is done with sign masks.
+    __m128i const fromX4 = _mm_set1_epi32(fromX);
+    __m128i const fromY4 = _mm_set1_epi32(fromY);
+    for(; i + 4 <= n; i += 4){
+        __m128i dx = _mm_sub_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(x + i)), fromX4);
+        __m128i dy = _mm_sub_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(y + i)), fromY4);
+        __m128i signX = _mm_srai_epi32(dx, 31);
+        __m128i signY = _mm_srai_epi32(dy, 31);
+        dx = _mm_sub_epi32(_mm_xor_si128(dx, signX), signX);
+        dy = _mm_sub_epi32(_mm_xor_si128(dy, signY), signY);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(distances + i), _mm_add_epi32(dx, dy));
+    }
+#endif
+    manhattan_distances_scalar(x + i, y + i, n - i, fromX, fromY, distances + i);
+}
+
+void manhattan_distances_scalar(int const* x, int const* y, std::size_t n, int fromX, int fromY, int* distances)
+{
+    for(std::size_t i = 0; i < n; ++i){
+        distances[i] = std::abs(x[i] - fromX) + std::abs(y[i] - fromY);
+    }
+}
+
+void LatencyHistogram::record(std::uint64_t nanoseconds)
+{
+    ++buckets[bucket(nanoseconds)];
+    ++total;
+    largest = std::max(largest, nanoseconds);
+}
+
+std::uint64_t LatencyHistogram::count() const
+{
+    return total;
+}
+
+std::uint64_t LatencyHistogram::max() const
+{
+    return largest;
+}
+
+std::uint64_t LatencyHistogram::percentile(double fraction) const
+{
+    std::uint64_t wanted = std::max<std::uint64_t>(1, std::ceil(fraction * total));
+    std::uint64_t seen = 0;
+    for(unsigned int index = 0; index < buckets.size(); ++index){
+        seen += buckets[index];
+        if(seen >= wanted){
+            return std::min(upper_edge(index), largest);
+        }
+    }
+    return largest;
+}
+
+void LatencyHistogram::reset()
+{
+    buckets.fill(0);
+    total = 0;
+    largest = 0;
+}
+
+// Values below SUB_BUCKETS have a bucket each. Bigger values are shifted right until they are
+// between SUB_BUCKETS and 2*SUB_BUCKETS, and the shift picks the group of sub-buckets.
+unsigned int LatencyHistogram::bucket(std::uint64_t value)
+{
+    if(value < SUB_BUCKETS){
+        return value;
+    }
+#if defined(__GNUC__)
+    unsigned int shift = 60 - __builtin_clzll(value);
+#else
+    unsigned int shift = 0;
+    while((value >> shift) >= 2 * SUB_BUCKETS){
+        ++shift;
+    }
+#endif
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+}
+
+std::uint64_t LatencyHistogram::upper_edge(unsigned int bucket)
+{
+    if(bucket < SUB_BUCKETS){
+        return bucket;
+    }
+    unsigned int shift = bucket / SUB_BUCKETS - 1;
+    std::uint64_t lower = std::uint64_t(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    return lower + (std::uint64_t(1) << shift) - 1;
+}
+
+namespace
+{
+// Names are string literals of the call sites, so only pointers are kept.
+std::mutex statsOperationsMutex;
+std::vector<char const*> statsOperations;
+}
+
+std::size_t stats_operation(char const* name)
+{
+    std::lock_guard<std::mutex> lock(statsOperationsMutex);
+    for(std::size_t operation = 0; operation < statsOperations.size(); ++operation){
+        if(std::strcmp(statsOperations[operation], name) == 0){
+            return operation;
+        }
+    }
+    statsOperations.push_back(name);
+    return statsOperations.size() - 1;
+}
+
+char const* stats_operation_name(std::size_t operation)
+{
+    std::lock_guard<std::mutex> lock(statsOperationsMutex);
+    return statsOperations[operation];
+}
+
+StatsTimer::~StatsTimer()
+{
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    if(operation >= stats.operations.size()){
+        stats.operations.resize(operation + 1);
+    }
+    stats.operations[operation].record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+std::string DatastructuresStats::dump() const
+{
+    std::ostringstream out;
+    out << "# TYPE datastructures_calls_total counter\n";
+    for(std::size_t operation = 0; operation < operations.size(); ++operation){
+        if(operations[operation].count() != 0){
+            out << "datastructures_calls_total{operation=\"" << stats_operation_name(operation) << "\"} "
+                << operations[operation].count() << "\n";
+        }
+    }
+
+    out << "# TYPE datastructures_latency_ns summary\n";
+    for(std::size_t operation = 0; operation < operations.size(); ++operation){
+        if(operations[operation].count() == 0){
+            continue;
+        }
+        for(char const* quantile : {"0.5", "0.9", "0.99", "0.999"}){
+            out << "datastructures_latency_ns{operation=\"" << stats_operation_name(operation) << "\",quantile=\""
+                << quantile << "\"} " << operations[operation].percentile(std::stod(quantile)) << "\n";
+        }
+        out << "datastructures_latency_ns_count{operation=\"" << stats_operation_name(operation) << "\"} "
+            << operations[operation].count() << "\n";
+    }
+
+    out << "# TYPE datastructures_latency_max_ns gauge\n";
+    for(std::size_t operation = 0; operation < operations.size(); ++operation){
+        if(operations[operation].count() != 0){
+            out << "datastructures_latency_max_ns{operation=\"" << stats_operation_name(operation) << "\"} "
+                << operations[operation].max() << "\n";
+        }
+    }
+
+    // Lines of the same counter come one after another and share one TYPE line.
+    char const* previous = "";
+    auto counter = [&out, &previous](char const* name, char const* labels, std::uint64_t value){
+        if(std::strcmp(previous, name) != 0){
+            out << "# TYPE " << name << " counter\n";
+            previous = name;
+        }
+        out << name << labels << " " << value << "\n";
+    };
+    counter("datastructures_lazy_sorts_total", "{index=\"alphabetical\"}", alphabeticalSorts);
+    counter("datastructures_lazy_sorts_total", "{index=\"distance\"}", distanceSorts);
+    counter("datastructures_lazy_sorted_elements_total", "{index=\"alphabetical\"}", alphabeticalSortedElements);
+    counter("datastructures_lazy_sorted_elements_total", "{index=\"distance\"}", distanceSortedElements);
+    counter("datastructures_lazy_merged_elements_total", "{index=\"alphabetical\"}", alphabeticalMergedElements);
+    counter("datastructures_lazy_merged_elements_total", "{index=\"distance\"}", distanceMergedElements);
+    counter("datastructures_compactions_total", "", compactions);
+    counter("datastructures_compacted_towns_total", "", compactedTowns);
+    counter("datastructures_live_count_builds_total", "", liveCountBuilds);
+    return out.str();
+}
+
+void DatastructuresStats::reset()
+{
+    for(LatencyHistogram& histogram : operations){
+        histogram.reset();
+    }
+    alphabeticalSorts = 0;
+    alphabeticalSortedElements = 0;
+    alphabeticalMergedElements = 0;
+    distanceSorts = 0;
+    distanceSortedElements = 0;
+    distanceMergedElements = 0;
+    compactions = 0;
+    compactedTowns = 0;
+    liveCountBuilds = 0;
+}
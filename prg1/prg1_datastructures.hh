@@ -5,6 +5,14 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <chrono>
+
+// Ranges shorter than this are merged in one thread even when more are allowed.
+std::size_t const PARALLEL_MERGE_THRESHOLD = 1 << 16;
 
 struct TownData
 {
@@ -12,8 +20,305 @@ struct TownData
     int x;
     int y;
     int TownDistance;
+    unsigned int slot; // Place of the town in TownPool and TownColumns.
+};
+
+// Coordinates and distances of every town as separate arrays indexed by slot, so
+// that a pass over coordinates doesn't pull names to cache. 'used' is 0 for slots
+// that don't belong to any town right now.
+struct TownColumns
+{
+    std::vector<int> x;
+    std::vector<int> y;
+    std::vector<int> distance;
+    std::vector<unsigned char> used;
+
+    // Stores coordinates of a town. Distance from origin is left for count_distances.
+    void set(unsigned int slot, int x, int y);
+
+    // Counts distances from origin for slots first..last-1 in one pass.
+    void count_distances(unsigned int first, unsigned int last);
+
+    void reserve(std::size_t towns);
+    void clear();
+};
+
+// One town given to add_towns.
+struct TownRecord
+{
+    std::string name;
+    int x;
+    int y;
+};
+
+// Writes |x[i]-fromX| + |y[i]-fromY| to distances[i] for n towns. Uses AVX2 or SSE2
+// when the compiler has them enabled and a plain loop for whatever is left over.
+void manhattan_distances(int const* x, int const* y, std::size_t n, int fromX, int fromY, int* distances);
+
+// Same as above with just the plain loop.
+void manhattan_distances_scalar(int const* x, int const* y, std::size_t n, int fromX, int fromY, int* distances);
+
+// Owns all TownData records. Records are made in big chunks instead of one by one,
+// and they never move, so pointers to them stay valid until they are released.
+class TownPool
+{
+public:
+    TownPool();
+
+    // Returns record for a new town. Reuses released records first.
+    TownData* create(std::string const& name, int x, int y);
+
+    // Gives record back to the pool for reuse.
+    void release(TownData* town);
+
+    // Returns record in the given slot.
+    TownData* at(unsigned int slot) const;
+
+    // Releases all records by freeing whole chunks.
+    void clear();
+
+private:
+    static unsigned int const CHUNK_SIZE = 1024;
+
+    std::vector<std::unique_ptr<TownData[]>> chunks;
+    unsigned int usedInLastChunk;
+    std::vector<TownData*> freeTowns;
+};
+
+// Stable sort for vectors of towns in the style of TimSort. Ascending and strictly descending
+// runs that are already in the data are kept as they are, runs shorter than a minimum are
+// extended with binary insertion sort and neighbouring runs are merged. Merges go through one
+// scratch buffer that is kept between calls, so a sort allocates only when the buffer has to
+// grow. Comparators are template parameters, so they are inlined instead of called through
+// pointers. Templates are defined in datastructures.cc, the only place that uses them.
+class TownSorter
+{
+public:
+    using Iterator = std::vector<TownData*>::iterator;
+
+    // Sorts [first, last) so that towns that are equal by 'less' keep their order.
+    template <typename Less>
+    void sort(Iterator first, Iterator last, Less less);
+
+    // Merges sorted [first, middle) and [middle, last). Equal towns of the first range stay first.
+    // Towns at both ends that are already in place are found with binary search and not moved.
+    template <typename Less>
+    void merge(Iterator first, Iterator middle, Iterator last, Less less);
+
+private:
+    struct Run
+    {
+        Iterator first;
+        std::size_t length;
+    };
+
+    std::vector<TownData*> scratch;
+    std::vector<Run> runs;
+
+    // Inserts towns of [sortedUntil, last) one by one to sorted [first, sortedUntil).
+    template <typename Less>
+    static void insertion_sort(Iterator first, Iterator sortedUntil, Iterator last, Less less);
+
+    // Merges runs on top of the stack until their lengths shrink fast enough towards the top,
+    // or until one run is left if 'all' is set.
+    template <typename Less>
+    void merge_runs(bool all, Less less);
+
+    // Merges runs i and i+1 of the stack.
+    template <typename Less>
+    void merge_at(std::size_t i, Less less);
+};
+
+// Min-max heap of town slots by distance from origin. Levels alternate between min levels and
+// max levels starting from the root, so the nearest town is the root and the farthest is the root
+// or one of its children. Every slot knows its position in the heap, so any town can be taken out.
+class DistanceHeap
+{
+public:
+    // Both are O(logn). Erase puts the last town in place of the removed one and moves it up or down.
+    void insert(int distance, unsigned int slot);
+    void erase(unsigned int slot);
+
+    // Slots of the nearest and the farthest town in O(1). Heap must not be empty. Among towns at the same
+    // distance the nearest is the one with the smallest slot and the farthest the one with the largest.
+    unsigned int min_slot() const;
+    unsigned int max_slot() const;
+
+    bool empty() const;
+    void reserve(std::size_t towns);
+    void clear();
+
+private:
+    // Distance and slot packed so that keys order by distance and then by slot.
+    std::vector<std::uint64_t> keys;
+    // Position of every slot in 'keys'.
+    std::vector<unsigned int> positions;
+
+    // Writes key to position and remembers where its slot is.
+    void place(std::size_t position, std::uint64_t key);
+    void swap_keys(std::size_t a, std::size_t b);
+    static bool on_max_level(std::size_t position);
+
+    // Move key at position up or down until both kinds of levels are in order again.
+    // 'max' tells which kind of levels the key is moved along.
+    void push_up(std::size_t position);
+    void push_up_along(std::size_t position, bool max);
+    void push_down(std::size_t position);
+};
+
+// Fenwick tree of live towns by their position in a sorted vector. Removed towns can then be
+// stepped over by counting instead of taking them out of the vector.
+class LiveCounts
+{
+public:
+    // Counts every position whose flag is not 0. Linear in the number of positions.
+    void build(std::vector<unsigned char> const& live);
+
+    // Both are O(logn). Find returns the position of the live town with n live towns before it.
+    void erase(std::size_t position);
+    std::size_t find(std::size_t n) const;
+
+    // Nothing is counted before build and after clear.
+    bool built() const;
+    void clear();
+
+private:
+    // counts[i] is the number of live positions in (i - lowest bit of i, i].
+    std::vector<unsigned int> counts;
+};
+
+// Read-only copy of all towns made by Datastructures::publish_snapshot(). The snapshot has
+// its own TownData records, nothing in it changes after it is made and no method writes
+// anywhere, so any number of threads can query it while Datastructures is being changed.
+class TownSnapshot
+{
+public:
+    TownSnapshot() = default;
+    TownSnapshot(TownSnapshot const&) = delete;
+    TownSnapshot& operator=(TownSnapshot const&) = delete;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Returns size of a vector.
+    unsigned int size() const;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Both orders are made when the snapshot is made, so only references are returned.
+    std::vector<TownData const*> const& towns_alphabetically() const;
+    std::vector<TownData const*> const& towns_distance_increasing() const;
+
+    // Estimate of performance: O(logn)
+    // Short rationale for estimate: Binary search from the alphabetical order.
+    TownData const* find_town(std::string const& name) const;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: First, last and n:th of the distance order.
+    TownData const* min_distance() const;
+    TownData const* max_distance() const;
+    TownData const* nth_distance(unsigned int n) const;
+
+    // Estimate of performance: Θ(n)
+    // Short rationale for estimate: Distances are counted with the vectorized kernel to a buffer of the call and radix sorted.
+    // Records are not written to.
+    std::vector<TownData const*> towns_distance_increasing_from(int x, int y) const;
+
+private:
+    friend class Datastructures;
+
+    // Records in alphabetical order. 'slot' of each record is its position here.
+    std::vector<TownData> towns;
+
+    // Coordinates in the same order as 'towns' for the distance kernel.
+    std::vector<int> x;
+    std::vector<int> y;
+
+    std::vector<TownData const*> alphabetical;
+    std::vector<TownData const*> byDistance;
+};
+
+// Instrumentation is compiled in only when DATASTRUCTURES_STATS is defined, for example
+// with -DDATASTRUCTURES_STATS. Without it the macros below expand to nothing and
+// dump_stats() returns an empty string.
+
+// Latency histogram in the style of HDR histograms. Buckets grow in powers of two and every
+// power of two is split in 8 linear sub-buckets, so a recorded value is known within 12.5 %
+// at any magnitude with a fixed 4 KB of counters.
+class LatencyHistogram
+{
+public:
+    void record(std::uint64_t nanoseconds);
+
+    std::uint64_t count() const;
+    std::uint64_t max() const;
+
+    // Returns upper edge of the bucket that holds the given fraction (0..1) of recorded values.
+    std::uint64_t percentile(double fraction) const;
+
+    void reset();
+
+private:
+    static unsigned int const SUB_BUCKETS = 8;
+
+    std::array<std::uint64_t, 64 * SUB_BUCKETS> buckets = {};
+    std::uint64_t total = 0;
+    std::uint64_t largest = 0;
+
+    static unsigned int bucket(std::uint64_t value);
+    static std::uint64_t upper_edge(unsigned int bucket);
 };
 
+// Returns a number for an operation name. Every call site asks once and keeps the number
+// in a static variable, so the name is looked up only on the first call.
+std::size_t stats_operation(char const* name);
+
+// Name of a number given by stats_operation.
+char const* stats_operation_name(std::size_t operation);
+
+// Calls and latencies of every operation and the work done by lazy index updates.
+struct DatastructuresStats
+{
+    // Latencies indexed by numbers from stats_operation.
+    std::vector<LatencyHistogram> operations;
+
+    std::uint64_t alphabeticalSorts = 0;           // Lazy sorts of TownsByAlphabets.
+    std::uint64_t alphabeticalSortedElements = 0;  // New towns sorted by them.
+    std::uint64_t alphabeticalMergedElements = 0;  // Towns merged by them.
+    std::uint64_t distanceSorts = 0;               // Lazy sorts of TownsByDistance.
+    std::uint64_t distanceSortedElements = 0;      // Towns sorted by them.
+    std::uint64_t distanceMergedElements = 0;      // Towns merged by them.
+    std::uint64_t compactions = 0;                 // Times removed towns were taken out of the vectors.
+    std::uint64_t compactedTowns = 0;              // Removed towns taken out by them.
+    std::uint64_t liveCountBuilds = 0;             // Times nth_distance built the live counts.
+
+    // Returns everything in Prometheus text format.
+    std::string dump() const;
+
+    void reset();
+};
+
+// Times the enclosing block and records it for the operation when it ends.
+class StatsTimer
+{
+public:
+    StatsTimer(DatastructuresStats& stats, std::size_t operation) :
+        stats(stats), operation(operation), start(std::chrono::steady_clock::now()) {}
+    ~StatsTimer();
+
+private:
+    DatastructuresStats& stats;
+    std::size_t operation;
+    std::chrono::steady_clock::time_point start;
+};
+
+#ifdef DATASTRUCTURES_STATS
+#define STATS_TIMER(name) \
+    static std::size_t const statsOperation = stats_operation(name); \
+    StatsTimer statsTimer(stats, statsOperation)
+#define STATS_ADD(counter, amount) (stats.counter += (amount))
+#else
+#define STATS_TIMER(name)
+#define STATS_ADD(counter, amount)
+#endif
+
 class Datastructures
 {
 public:
@@ -25,87 +330,174 @@ public:
     unsigned int size();
 
     // Estimate of performance: Θ(n)
-    // Short rationale for estimate: The function geos linearly through all the items that have been added to vectors and struct.
+    // Short rationale for estimate: Vectors are cleared linearly. Towns are freed a whole chunk at a time.
     void clear();
 
     // Estimate of performance: O(1)
-    // Short rationale for estimate: It only returns the needed vector.
-    std::vector<TownData*> all_towns();
+    // Short rationale for estimate: It only returns reference to the needed vector, nothing is copied.
+    // Live towns are kept in their own unordered vector, which remove_town updates in O(1).
+    std::vector<TownData*> const& all_towns();
 
-    // Estimate of performance: Θ(1)
-    // Short rationale for estimate: This function creates one new TownData for struct and pushes it to vectors.
-    // Also manages some variables.
+    // Estimate of performance: O(logn)
+    // Short rationale for estimate: This function takes one new TownData from the pool and pushes it to vectors.
+    // Also manages some variables and adds the town to the distance heap.
     TownData* add_town(std::string const& name, int x, int y);
 
+    // Estimate of performance: O(nlogn)
+    // Short rationale for estimate: Vectors are reserved once, all towns are added and then both vectors are
+    // sorted once. Returns the new towns in the same order as the records.
+    std::vector<TownData*> add_towns(std::vector<TownRecord> const& towns);
+
     // Estimate of performance: O(nlogn)
     // Short rationale for estimate: This function calls merge sort which is why its worst-case is nlogn. It also might go with just Θ(1) when
     // the towns are already in order. If used vector is ordered to some point, it only orders the items that are not in order and then combines
-    // these two parts.
-    std::vector<TownData*> towns_alphabetically();
+    // these two parts. Removed towns still in the vector are taken out first in Θ(n), as the caller gets all of it.
+    std::vector<TownData*> const& towns_alphabetically();
 
     // Estimate of performance: O(nlogn)
     // Short rationale for estimate: Same rationale as above because exact same function as towns_alphabetically().
-    std::vector<TownData*> towns_distance_increasing();
+    std::vector<TownData*> const& towns_distance_increasing();
 
     // Estimate of performance: O(nlogn)
     // Short rationale for estimate: Has the same merge sort as two functions above. Also has binary search which has worst-case of O(logn).
     TownData* find_town(std::string const& name);
 
-    // Estimate of performance: O(nlogn)
-    // Short rationale for estimate: Also uses merge sort if town are not in order already. If towns are in order, the function just returns
-    // the first item in vector that is oredered by distance.
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Nearest town is the root of the distance heap, which add_town and remove_town
+    // keep up to date in O(logn), so TownsByDistance doesn't have to be sorted.
     TownData* min_distance();
 
-    // Estimate of performance: O(nlogn)
-    // Short rationale for estimate: Works as min_distance() but returns the last iteam.
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Works as min_distance() but returns the farthest town of the heap.
     TownData* max_distance();
 
-    // Estimate of performance: O(nlogn)
-    // Short rationale for estimate: Uses merge sort to sort TownsByDistance vector and then returns asked item.
-    // Also checks for valid input.
+    // Estimate of performance: O(logn), O(nlogn) if new towns have to be sorted first
+    // Short rationale for estimate: Uses merge sort to sort TownsByDistance vector and then finds asked item
+    // from the live counts, which step over removed towns. Counts are rebuilt in Θ(n) after sorts and compactions.
     TownData* nth_distance(unsigned int n);
 
     // Non-compulsory operations
 
-    // Estimate of performance: O(nlogn), Ω(n)
-    // Short rationale for estimate: Uses merge sort to sort the items in vector. After that it searches the needed item with binary search.
-    // Then removes the item and then it needs to copy TownsByAlphabets vector to TownsByDistance which is linear function.
-    // Also removing (erase()) is linear.
+    // Estimate of performance: O(logn) amortized, O(nlogn) if new towns have to be sorted first
+    // Short rationale for estimate: Binary search from the alphabetical vector after which the town is only marked removed
+    // and taken out of the distance heap, the live towns and the live counts.
+    // Removed towns are stepped over by searches and taken out of both vectors in one linear pass when they are
+    // the majority or when a whole sorted vector is asked, so the distance order is never sorted again.
     void remove_town(std::string const& town_name);
 
+    // Estimate of performance: Θ(n)
+    // Short rationale for estimate: New distances are counted in one vectorized pass over the coordinate columns to a key buffer
+    // of the call and the keys are radix sorted, which is a few linear passes. Records are not written to, so the distances
+    // from origin stay as they are.
+    std::vector<TownData*> towns_distance_increasing_from(int x, int y) const;
+
+    // Estimate of performance: O(n + klogk)
+    // Short rationale for estimate: Distances are counted like above, nth_element picks the k nearest towns in linear time
+    // and only they are sorted. Returns all towns if there are fewer than k.
+    std::vector<TownData*> nearest_towns(int x, int y, unsigned int k) const;
+
+    // Snapshot operations
+
     // Estimate of performance: Θ(nlogn)
-    // Short rationale for estimate: Creates temporary vector in which saves towns with new calculated distances. After that merge sort is needed
-    // for sorting. The new vector can't be in order and because of that performance is Θ(nlogn).
-    std::vector<TownData*> towns_distance_increasing_from(int x, int y);
+    // Short rationale for estimate: Every town is copied to a new snapshot in alphabetical order and the copies are
+    // sorted by distance. The snapshot replaces the old one with one atomic store, so readers of the old snapshot
+    // are not disturbed and it is freed when the last of them lets go. atomic_store on a shared_ptr takes a short
+    // lock inside the standard library, so it is not lock-free. Only one thread may change Datastructures
+    // at a time.
+    void publish_snapshot();
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Atomic load of the latest published snapshot. Safe to call from any thread.
+    // The load takes the same short standard library lock as publish_snapshot() while the pointer is copied.
+    // Queries on the returned snapshot take no locks. The snapshot is empty before the first publish_snapshot()
+    // and doesn't see later changes until republished.
+    std::shared_ptr<TownSnapshot const> snapshot() const;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Only stores the settings.
+    // Sets how many threads merging of the vectors may use. 0 means one for every hardware thread
+    // and 1 turns parallel merging off. Ranges shorter than threshold are always merged in one thread.
+    // New towns are always sorted in the calling thread before they are merged.
+    void set_merge_threads(unsigned int threads, std::size_t threshold = PARALLEL_MERGE_THRESHOLD);
+
+    // Instrumentation
+
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: Goes once through the k operations that have been called.
+    // Returns call counts, latency percentiles and work of lazy index updates in Prometheus text format.
+    // Empty when compiled without DATASTRUCTURES_STATS.
+    std::string dump_stats() const;
+
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: Zeroes the histograms of k operations and all counters.
+    void reset_stats();
 
 private:
     // Add stuff needed for your class implementation here
 
+    // Owns the TownData of every town.
+    TownPool pool;
+
+    // Coordinates and distances of all towns indexed by slot.
+    TownColumns Columns;
+
+    // Sorts new towns of the vectors below in the calling thread.
+    TownSorter sorter;
+
+    // Nearest and farthest town for min_distance and max_distance without sorting TownsByDistance.
+    DistanceHeap distanceHeap;
+
     // Two vectors for storing data.
     std::vector<TownData*> TownsByAlphabets; // Stores towns by alphabets.
-    std::vector<TownData*> TownsByDistance; // Stores towns by distances.
+    std::vector<TownData*> TownsByDistance; // Stores towns by distances and then by slots.
+
+    // Towns that have not been removed in no order for all_towns, and the position of each slot in it.
+    std::vector<TownData*> liveTowns;
+    std::vector<unsigned int> livePositions;
+
+    // Live towns of the sorted part of TownsByDistance for nth_distance. Cleared when the part changes.
+    LiveCounts distanceCounts;
 
     // Three variables for count keeping.
     int TownCount; // Counts amount of towns.
     int addedItemsToAlpha; // Counts how many towns have been added after last alphabetical merge sort.
     int addedItemsToDist; // Counts how many towns have been added after last merge sort for distances.
+    int removedTowns; // Removed towns that are still in both vectors. TownCount doesn't count them.
+
+    // Latest snapshot given to readers. Only accessed with atomic_load and atomic_store, which libstdc++
+    // guards with a pool of mutexes.
+    std::shared_ptr<TownSnapshot const> published;
 
-    // Definition for merge.
-    void merge(std::vector<TownData*> &aVector, int low, int middle, int high,
-               bool (Datastructures::*compare)
-               (std::vector<TownData*> &left, std::vector<TownData*> &right, int i, int j));
+    // Settings given to set_merge_threads.
+    unsigned int mergeThreads;
+    std::size_t mergeThreshold;
 
-    // Definition for merge sort.
-    void mergeSort(std::vector<TownData*> &aVector, int low, int high,
-                   bool (Datastructures::*compare)
-                   (std::vector<TownData*> &left, std::vector<TownData*> &right, int i, int j));
+    // Returns how many threads a merge may use.
+    unsigned int merge_thread_count() const;
 
-    // These are needed for deciding whether to compare alphabets or distances.
-    bool alphabetical(std::vector<TownData*> &left, std::vector<TownData*> &right, int i, int j);
-    bool byDistance(std::vector<TownData*> &left, std::vector<TownData*> &right, int i, int j);
+    // Calls, latencies and lazy index work. Updated through STATS_TIMER and STATS_ADD. Mutable so that
+    // const queries are counted too, which makes concurrent const calls unsafe in builds with stats.
+    // Declared in every build so that the class looks the same with and without DATASTRUCTURES_STATS.
+    mutable DatastructuresStats stats;
 
     // Definitions for binary search.
-    int alphabetBinarySearch(std::vector<TownData*> &aVector, int left, int right, std::string x);
+    int alphabetBinarySearch(std::vector<TownData*> &aVector, int left, int right, std::string const& x);
+
+    // True for towns that have been removed but are still in the vectors.
+    bool is_removed(TownData* town) const;
+
+    // Takes removed towns out of the vectors and releases them to the pool.
+    void compact();
+
+    // Adds a town to liveTowns and takes it out by swapping the last town to its place.
+    void add_live(TownData* town);
+    void remove_live(unsigned int slot);
+
+    // Distances from a point for towns_distance_increasing_from and nearest_towns. Distances and slots are
+    // packed to 64-bit keys in a buffer of the call, so the queries don't write anywhere.
+    std::vector<std::uint64_t> distances_from(int x, int y) const;
+    std::vector<TownData*> towns_of(std::vector<std::uint64_t>::const_iterator first,
+                                    std::vector<std::uint64_t>::const_iterator last) const;
 
     // Just functions that sort vectors TownsByAlphabets and TownsByDistance if needed. Does not return anything.
     void sort_towns_by_alphabets();
@@ -0,0 +1,338 @@
+// Model_check.cc
+//
+// Runs random operations on Datastructures and on a naive model of the same towns and
+// compares every answer. The model keeps towns in a std::map by their TownData and answers
+// queries the obvious way, by going through all towns. Towns at the same distance or with
+// the same name may be in any order, so orders are checked to be sorted and to have exactly
+// the towns of the model. Every CHECK_INTERVAL operations all queries are checked, and the
+// latest published snapshot is checked against the towns it was published with.
+// Prints the first difference and exits with 1. Otherwise prints one JSON line:
+//   {"program":"prg1","seed":1,"operations":100000,"towns":500}
+// Build together with the datastructures, for example:
+//   g++ -std=c++17 -O2 -pthread prg1_model_check.cc prg1_datastructures.cc -o model_check
+// (with datastructures.hh available under that name like for the main program).
+// Usage: model_check [seed, default 1] [operations, default 100000]
+
+#include "datastructures.hh"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+// Towns are removed instead of added when there are this many, so the naive queries stay fast.
+std::size_t const MAX_TOWNS = 500;
+
+// Operations between checks of all queries.
+unsigned long const CHECK_INTERVAL = 2000;
+
+std::minstd_rand rand_engine;
+
+int random_in_range(int start, int end)
+{
+    return std::uniform_int_distribution<int>(start, end)(rand_engine);
+}
+
+// Short names made of the letters a, b and c, so that names are often the same.
+std::string random_name()
+{
+    std::string name(random_in_range(1, 4), 'a');
+    for(char& letter : name){
+        letter = 'a' + random_in_range(0, 2);
+    }
+    return name;
+}
+
+struct ModelTown
+{
+    std::string name;
+    int x;
+    int y;
+};
+
+// Towns by the TownData given for them with every query done the slow and obvious way.
+class Model
+{
+public:
+    std::map<TownData const*, ModelTown> towns;
+
+    bool contains(TownData const* town) const
+    {
+        return towns.count(town) != 0;
+    }
+
+    int distance(TownData const* town, int x, int y) const
+    {
+        ModelTown const& data = towns.at(town);
+        return std::abs(data.x - x) + std::abs(data.y - y);
+    }
+
+    // Distances from origin in increasing order.
+    std::vector<int> distances() const
+    {
+        std::vector<int> distances;
+        for(auto const& town : towns){
+            distances.push_back(distance(town.first, 0, 0));
+        }
+        std::sort(distances.begin(), distances.end());
+        return distances;
+    }
+
+    bool has_name(std::string const& name) const
+    {
+        return std::any_of(towns.begin(), towns.end(), [&name](auto const& town){
+            return town.second.name == name;
+        });
+    }
+};
+
+class Checker
+{
+public:
+    explicit Checker(unsigned int seed) : seed(seed)
+    {
+        // Small threshold makes even small batches go through the parallel merges.
+        if(seed % 2 == 1){
+            towns.set_merge_threads(seed % 4 + 1, 8);
+        }
+    }
+
+    void run(unsigned long operations)
+    {
+        for(step = 1; step <= operations; ++step){
+            int operation = random_in_range(0, 99);
+            if(operation < 30){
+                model.towns.size() < MAX_TOWNS ? add_town() : remove_town();
+            }
+            else if(operation < 32){
+                model.towns.size() < MAX_TOWNS ? add_towns() : remove_town();
+            }
+            else if(operation < 50){
+                remove_town();
+            }
+            else if(operation < 65){
+                check_find_town(random_town_name());
+            }
+            else if(operation < 85){
+                check_distances();
+            }
+            else if(operation < 95){
+                check_orders();
+            }
+            else if(operation < 97){
+                towns.publish_snapshot();
+                published = model;
+            }
+            else {
+                check_snapshot();
+            }
+
+            if(step % CHECK_INTERVAL == 0){
+                check_orders();
+                check_distances();
+                check_snapshot();
+            }
+        }
+        std::cout << "{\"program\":\"prg1\",\"seed\":" << seed << ",\"operations\":" << operations
+                  << ",\"towns\":" << model.towns.size() << "}" << std::endl;
+    }
+
+private:
+    unsigned int seed;
+    Datastructures towns;
+    Model model;
+    unsigned long step = 0;
+
+    // Towns when the snapshot was last published. Records of the snapshot are its own, so they
+    // are compared by contents.
+    Model published;
+
+    void check(char const* what, bool ok) const
+    {
+        if(!ok){
+            std::cerr << "prg1 seed " << seed << " step " << step << ": " << what << " differs from the model" << std::endl;
+            std::exit(1);
+        }
+    }
+
+    // Mostly names of towns that exist, sometimes names no town has.
+    std::string random_town_name()
+    {
+        if(!model.towns.empty() && random_in_range(0, 3) != 0){
+            return std::next(model.towns.begin(), random_in_range(0, model.towns.size() - 1))->second.name;
+        }
+        return random_name();
+    }
+
+    // TownData must be a new record with the given contents.
+    void check_added(char const* what, TownData const* town, ModelTown const& data)
+    {
+        check(what, town != nullptr && !model.contains(town) && town->name == data.name && town->x == data.x
+                    && town->y == data.y && town->TownDistance == std::abs(data.x) + std::abs(data.y));
+        model.towns[town] = data;
+    }
+
+    void add_town()
+    {
+        ModelTown data = {random_name(), random_in_range(-100, 100), random_in_range(-100, 100)};
+        check_added("add_town", towns.add_town(data.name, data.x, data.y), data);
+    }
+
+    void add_towns()
+    {
+        std::vector<TownRecord> records(random_in_range(0, 200));
+        for(TownRecord& record : records){
+            record = {random_name(), random_in_range(-100, 100), random_in_range(-100, 100)};
+        }
+        std::vector<TownData*> added = towns.add_towns(records);
+        check("add_towns", added.size() == records.size());
+        for(std::size_t i = 0; i < records.size(); ++i){
+            check_added("add_towns", added[i], {records[i].name, records[i].x, records[i].y});
+        }
+    }
+
+    // Any one town with the name may go, so the town that went is looked up from all_towns.
+    void remove_town()
+    {
+        std::string name = random_town_name();
+        towns.remove_town(name);
+
+        std::map<TownData const*, ModelTown> left;
+        for(TownData* town : towns.all_towns()){
+            check("remove_town", model.contains(town));
+            left[town] = model.towns[town];
+        }
+        std::size_t removed = model.towns.size() - left.size();
+        check("remove_town", removed == (model.has_name(name) ? 1 : 0));
+        for(auto const& town : model.towns){
+            check("remove_town", left.count(town.first) != 0 || town.second.name == name);
+        }
+        model.towns.swap(left);
+        check("size", towns.size() == model.towns.size());
+    }
+
+    void check_find_town(std::string const& name)
+    {
+        TownData* found = towns.find_town(name);
+        check("find_town", model.has_name(name) ? model.contains(found) && found->name == name : found == nullptr);
+    }
+
+    void check_distances()
+    {
+        std::vector<int> distances = model.distances();
+        auto distance_is = [this](TownData const* town, int distance){
+            return model.contains(town) && model.distance(town, 0, 0) == distance;
+        };
+        if(distances.empty()){
+            check("min_distance", towns.min_distance() == nullptr);
+            check("max_distance", towns.max_distance() == nullptr);
+        }
+        else {
+            check("min_distance", distance_is(towns.min_distance(), distances.front()));
+            check("max_distance", distance_is(towns.max_distance(), distances.back()));
+        }
+        unsigned int n = random_in_range(0, distances.size() + 1);
+        TownData* nth = towns.nth_distance(n);
+        check("nth_distance", n == 0 || n > distances.size() ? nth == nullptr : distance_is(nth, distances[n - 1]));
+
+        int x = random_in_range(-120, 120);
+        int y = random_in_range(-120, 120);
+        std::vector<TownData*> all = towns.towns_distance_increasing_from(x, y);
+        check_by_distance("towns_distance_increasing_from", all, x, y);
+
+        unsigned int k = random_in_range(0, 20);
+        std::vector<TownData*> nearest = towns.nearest_towns(x, y, k);
+        check("nearest_towns", nearest.size() == std::min<std::size_t>(k, all.size()));
+        for(std::size_t i = 0; i < nearest.size(); ++i){
+            check("nearest_towns", model.contains(nearest[i]) && model.distance(nearest[i], x, y) == model.distance(all[i], x, y));
+        }
+    }
+
+    // Towns must be all towns of the model in order of distance from (x, y).
+    void check_by_distance(char const* what, std::vector<TownData*> order, int x, int y)
+    {
+        check(what, order.size() == model.towns.size());
+        for(std::size_t i = 0; i < order.size(); ++i){
+            check(what, model.contains(order[i]));
+            check(what, i == 0 || model.distance(order[i - 1], x, y) <= model.distance(order[i], x, y));
+        }
+        std::sort(order.begin(), order.end());
+        check(what, std::adjacent_find(order.begin(), order.end()) == order.end());
+    }
+
+    void check_orders()
+    {
+        std::vector<TownData*> alphabetical = towns.towns_alphabetically();
+        check("towns_alphabetically", alphabetical.size() == model.towns.size());
+        for(std::size_t i = 0; i < alphabetical.size(); ++i){
+            check("towns_alphabetically", model.contains(alphabetical[i]));
+            check("towns_alphabetically", i == 0 || alphabetical[i - 1]->name <= alphabetical[i]->name);
+        }
+        std::sort(alphabetical.begin(), alphabetical.end());
+        check("towns_alphabetically", std::adjacent_find(alphabetical.begin(), alphabetical.end()) == alphabetical.end());
+
+        std::vector<TownData*> all = towns.all_towns();
+        std::sort(all.begin(), all.end());
+        check("all_towns", all == alphabetical);
+
+        check_by_distance("towns_distance_increasing", towns.towns_distance_increasing(), 0, 0);
+        check("size", towns.size() == model.towns.size());
+    }
+
+    // Snapshot must have the towns that there were when it was published, in both orders.
+    void check_snapshot()
+    {
+        std::shared_ptr<TownSnapshot const> snapshot = towns.snapshot();
+        check("snapshot size", snapshot->size() == published.towns.size());
+
+        std::vector<std::pair<std::string, int>> expected;
+        for(auto const& town : published.towns){
+            expected.push_back({town.second.name, published.distance(town.first, 0, 0)});
+        }
+        std::sort(expected.begin(), expected.end());
+
+        std::vector<std::pair<std::string, int>> alphabetical;
+        for(TownData const* town : snapshot->towns_alphabetically()){
+            check("snapshot towns_alphabetically", alphabetical.empty() || alphabetical.back().first <= town->name);
+            alphabetical.push_back({town->name, std::abs(town->x) + std::abs(town->y)});
+        }
+        std::sort(alphabetical.begin(), alphabetical.end());
+        check("snapshot towns_alphabetically", alphabetical == expected);
+
+        std::vector<TownData const*> const& byDistance = snapshot->towns_distance_increasing();
+        check("snapshot towns_distance_increasing", byDistance.size() == expected.size());
+        for(std::size_t i = 1; i < byDistance.size(); ++i){
+            check("snapshot towns_distance_increasing", byDistance[i - 1]->TownDistance <= byDistance[i]->TownDistance);
+        }
+        if(!byDistance.empty()){
+            check("snapshot min_distance", snapshot->min_distance() == byDistance.front());
+            check("snapshot max_distance", snapshot->max_distance() == byDistance.back());
+            unsigned int n = random_in_range(1, byDistance.size());
+            check("snapshot nth_distance", snapshot->nth_distance(n)->TownDistance == byDistance[n - 1]->TownDistance);
+        }
+
+        std::string name = random_name();
+        TownData const* found = snapshot->find_town(name);
+        check("snapshot find_town", published.has_name(name) ? found != nullptr && found->name == name : found == nullptr);
+    }
+};
+
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int seed = argc > 1 ? std::stoul(argv[1]) : 1;
+    unsigned long operations = argc > 2 ? std::stoul(argv[2]) : 100000;
+    rand_engine.seed(seed);
+
+    Checker checker(seed);
+    checker.run(operations);
+    return 0;
+}
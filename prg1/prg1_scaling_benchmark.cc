@@ -0,0 +1,262 @@
+// Scaling_benchmark.cc
+//
+// Times the public operations of Datastructures with 10^3 ... 10^7 towns and fits the
+// measured times to the usual complexity classes. Every measurement is printed as one
+// JSON line:
+//   {"program":"prg1","operation":"find_town","towns":1000,"calls":100000,"ns_per_call":85.1}
+// and after all sizes one line per operation with the best fitting class and the slope
+// of log(time) against log(towns):
+//   {"program":"prg1","operation":"find_town","fit":"O(logn)","exponent":0.08}
+// The class is given only when its own slope over the same sizes is close to the measured
+// one. Otherwise "fit" is "none", as the times don't follow any of the classes well.
+// Build together with the datastructures, for example:
+//   g++ -std=c++17 -O2 -march=native -pthread prg1_scaling_benchmark.cc prg1_datastructures.cc -o scaling_benchmark
+// (with datastructures.hh available under that name like for the main program).
+// Usage: scaling_benchmark [largest number of towns, default 1000000]
+
+#include "datastructures.hh"
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+// Time that one operation may take at one size before it stops repeating calls.
+std::chrono::milliseconds const BUDGET(200);
+
+// How far the measured slope may be from the slope of the best fitting class.
+double const SLOPE_TOLERANCE = 0.25;
+
+std::minstd_rand rand_engine;
+
+// Results are added here so that the compiler can't leave calls out.
+std::size_t sink = 0;
+
+int random_in_range(int start, int end)
+{
+    return std::uniform_int_distribution<int>(start, end)(rand_engine);
+}
+
+std::string random_name()
+{
+    std::string name(8, 'a');
+    for(char& letter : name){
+        letter = 'a' + random_in_range(0, 25);
+    }
+    return name;
+}
+
+// Collects measurements and prints them as JSON lines.
+class Results
+{
+public:
+    explicit Results(char const* program) : program(program) {}
+
+    void add(std::string const& operation, std::size_t towns, std::size_t calls, double nanoseconds)
+    {
+        double perCall = nanoseconds / calls;
+        measurements[operation].push_back({double(towns), perCall});
+        std::cout << "{\"program\":\"" << program << "\",\"operation\":\"" << operation
+                  << "\",\"towns\":" << towns << ",\"calls\":" << calls
+                  << ",\"ns_per_call\":" << perCall << "}" << std::endl;
+    }
+
+    // Fits time = c*f(towns) for every class f with least relative squared error and prints the best.
+    void print_fits() const
+    {
+        std::vector<std::pair<char const*, double (*)(double)>> const classes = {
+            {"O(1)", [](double){ return 1.0; }},
+            {"O(logn)", [](double n){ return std::log2(n); }},
+            {"O(n)", [](double n){ return n; }},
+            {"O(nlogn)", [](double n){ return n * std::log2(n); }},
+            {"O(n^2)", [](double n){ return n * n; }},
+        };
+
+        for(auto const& operation : measurements){
+            auto const& points = operation.second;
+            if(points.size() < 2){
+                continue;
+            }
+
+            std::size_t best = 0;
+            double bestError = std::numeric_limits<double>::max();
+            for(std::size_t i = 0; i < classes.size(); ++i){
+                double a = 0;
+                double b = 0;
+                for(auto const& point : points){
+                    double relative = classes[i].second(point.first) / point.second;
+                    a += relative;
+                    b += relative * relative;
+                }
+                double scale = a / b;
+                double error = 0;
+                for(auto const& point : points){
+                    double difference = 1 - scale * classes[i].second(point.first) / point.second;
+                    error += difference * difference;
+                }
+                if(error < bestError){
+                    bestError = error;
+                    best = i;
+                }
+            }
+
+            double exponent = slope(points, [](double, double time){ return time; });
+            double expected = slope(points, [&classes, best](double towns, double){
+                return classes[best].second(towns);
+            });
+            char const* fit = std::abs(exponent - expected) <= SLOPE_TOLERANCE ? classes[best].first : "none";
+
+            std::cout << "{\"program\":\"" << program << "\",\"operation\":\"" << operation.first
+                      << "\",\"fit\":\"" << fit << "\",\"exponent\":" << exponent << "}" << std::endl;
+        }
+    }
+
+private:
+    char const* program;
+    std::map<std::string, std::vector<std::pair<double, double>>> measurements;
+
+    // Least squares slope of log(value(towns, time)) against log(towns).
+    template <typename Value>
+    static double slope(std::vector<std::pair<double, double>> const& points, Value value)
+    {
+        double meanX = 0;
+        double meanY = 0;
+        for(auto const& point : points){
+            meanX += std::log(point.first) / points.size();
+            meanY += std::log(value(point.first, point.second)) / points.size();
+        }
+        double covariance = 0;
+        double variance = 0;
+        for(auto const& point : points){
+            covariance += (std::log(point.first) - meanX) * (std::log(value(point.first, point.second)) - meanY);
+            variance += (std::log(point.first) - meanX) * (std::log(point.first) - meanX);
+        }
+        return covariance / variance;
+    }
+};
+
+// Calls call(i) for i = 0, 1, ... until maxCalls calls are done or the budget is used up.
+template <typename Call>
+void measure(Results& results, std::string const& operation, std::size_t towns, std::size_t maxCalls, Call call)
+{
+    auto start = Clock::now();
+    std::size_t calls = 0;
+    do{
+        call(calls);
+        ++calls;
+    } while(calls < maxCalls && Clock::now() - start < BUDGET);
+    auto end = Clock::now();
+    results.add(operation, towns, calls, std::chrono::duration<double, std::nano>(end - start).count());
+}
+
+void run(Results& results, std::size_t towns)
+{
+    std::vector<TownRecord> records;
+    records.reserve(towns);
+    for(std::size_t i = 0; i < towns; ++i){
+        records.push_back({random_name(), random_in_range(-1000000, 1000000), random_in_range(-1000000, 1000000)});
+    }
+    auto random_name_of_town = [&records]() -> std::string const& {
+        return records[random_in_range(0, records.size() - 1)].name;
+    };
+
+    {
+        Datastructures bulk;
+        measure(results, "add_towns", towns, 1, [&](std::size_t){
+            sink += bulk.add_towns(records).size();
+        });
+    }
+
+    Datastructures ds;
+    measure(results, "add_town", towns, towns, [&](std::size_t i){
+        sink += ds.add_town(records[i].name, records[i].x, records[i].y)->x;
+    });
+    // Budget may stop adding early, so the rest is added without timing.
+    for(std::size_t i = ds.size(); i < towns; ++i){
+        ds.add_town(records[i].name, records[i].x, records[i].y);
+    }
+
+    measure(results, "towns_alphabetically_first", towns, 1, [&](std::size_t){
+        sink += ds.towns_alphabetically().size();
+    });
+    measure(results, "towns_distance_increasing_first", towns, 1, [&](std::size_t){
+        sink += ds.towns_distance_increasing().size();
+    });
+    measure(results, "towns_alphabetically", towns, 100000, [&](std::size_t){
+        sink += ds.towns_alphabetically().size();
+    });
+    measure(results, "towns_distance_increasing", towns, 100000, [&](std::size_t){
+        sink += ds.towns_distance_increasing().size();
+    });
+    measure(results, "all_towns", towns, 100000, [&](std::size_t){
+        sink += ds.all_towns().size();
+    });
+
+    measure(results, "find_town", towns, 100000, [&](std::size_t){
+        sink += ds.find_town(random_name_of_town()) != nullptr;
+    });
+    measure(results, "min_distance", towns, 100000, [&](std::size_t){
+        sink += ds.min_distance()->x;
+    });
+    measure(results, "max_distance", towns, 100000, [&](std::size_t){
+        sink += ds.max_distance()->x;
+    });
+    measure(results, "nth_distance", towns, 100000, [&](std::size_t){
+        sink += ds.nth_distance(random_in_range(1, towns))->x;
+    });
+
+    measure(results, "towns_distance_increasing_from", towns, 20, [&](std::size_t){
+        sink += ds.towns_distance_increasing_from(random_in_range(-1000000, 1000000), random_in_range(-1000000, 1000000)).size();
+    });
+    measure(results, "nearest_towns", towns, 20, [&](std::size_t){
+        sink += ds.nearest_towns(random_in_range(-1000000, 1000000), random_in_range(-1000000, 1000000), 10).size();
+    });
+
+    measure(results, "publish_snapshot", towns, 10, [&](std::size_t){
+        ds.publish_snapshot();
+        sink += ds.snapshot()->size();
+    });
+
+    // Mixes where every query comes right after a change and has to update the lazy vectors first.
+    measure(results, "add_town+find_town", towns, 1000, [&](std::size_t){
+        std::string name = random_name();
+        ds.add_town(name, 0, 0);
+        sink += ds.find_town(name) != nullptr;
+    });
+    measure(results, "add_town+min_distance", towns, 1000, [&](std::size_t){
+        ds.add_town(random_name(), random_in_range(-1000000, 1000000), random_in_range(-1000000, 1000000));
+        sink += ds.min_distance()->x;
+    });
+    measure(results, "remove_town+min_distance", towns, 1000, [&](std::size_t){
+        ds.remove_town(random_name_of_town());
+        sink += ds.min_distance() != nullptr;
+    });
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    std::size_t largest = argc > 1 ? std::stoul(argv[1]) : 1000000;
+
+    Results results("prg1");
+    for(std::size_t towns = 1000; towns <= largest; towns *= 10){
+        run(results, towns);
+        if(towns * 3 <= largest){
+            run(results, towns * 3);
+        }
+    }
+    results.print_fits();
+
+    std::cerr << "sink " << sink << std::endl;
+    return 0;
+}
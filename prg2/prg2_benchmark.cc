@@ -0,0 +1,103 @@
+// Benchmark.cc
+//
+// Compares the vectorized Manhattan distance kernel to plain loops.
+// Build together with the datastructures, for example:
+//   g++ -std=c++17 -O2 -march=native -pthread prg2_benchmark.cc prg2_datastructures.cc -o benchmark
+// (with datastructures.hh available under that name like for the main program).
+
+#include "datastructures.hh"
+
+#include <chrono>
+#include <iostream>
+#include <random>
+
+namespace
+{
+
+std::minstd_rand rand_engine;
+
+int random_coordinate()
+{
+    return std::uniform_int_distribution<int>(-1000000, 1000000)(rand_engine);
+}
+
+// Layout that towns had before the coordinate columns: one struct per town.
+struct OldTownData
+{
+    std::string name;
+    int x;
+    int y;
+    int TownDistance;
+    int tax;
+    int distanceFrom;
+};
+
+// Runs 'work' 'rounds' times and returns average time in nanoseconds per town.
+template <typename Work>
+double time_per_town(Work work, std::size_t towns, int rounds)
+{
+    auto start = std::chrono::steady_clock::now();
+    for(int round = 0; round < rounds; ++round){
+        work();
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / (double(towns) * rounds);
+}
+
+}
+
+int main()
+{
+    std::size_t const towns = 1000000;
+    int const rounds = 50;
+
+    std::vector<OldTownData> records(towns);
+    std::vector<int> x(towns);
+    std::vector<int> y(towns);
+    for(std::size_t i = 0; i < towns; ++i){
+        x[i] = random_coordinate();
+        y[i] = random_coordinate();
+        records[i] = {"Town " + std::to_string(i), x[i], y[i], 0, 0, 0};
+    }
+    std::vector<int> distances(towns);
+    int fromX = random_coordinate();
+    int fromY = random_coordinate();
+
+    double oldLoop = time_per_town([&](){
+        for(OldTownData& town : records){
+            town.distanceFrom = std::abs(town.x - fromX) + std::abs(town.y - fromY);
+        }
+    }, towns, rounds);
+
+    double scalar = time_per_town([&](){
+        manhattan_distances_scalar(x.data(), y.data(), towns, fromX, fromY, distances.data());
+    }, towns, rounds);
+
+    double kernel = time_per_town([&](){
+        manhattan_distances(x.data(), y.data(), towns, fromX, fromY, distances.data());
+    }, towns, rounds);
+
+#if defined(__AVX2__)
+    char const* instructions = "AVX2";
+#elif defined(__SSE2__)
+    char const* instructions = "SSE2";
+#else
+    char const* instructions = "none";
+#endif
+
+    std::cout << "towns: " << towns << ", vector instructions: " << instructions << std::endl;
+    std::cout << "struct per town loop:  " << oldLoop << " ns/town" << std::endl;
+    std::cout << "scalar column loop:    " << scalar << " ns/town" << std::endl;
+    std::cout << "vectorized kernel:     " << kernel << " ns/town (" << oldLoop / kernel << "x)" << std::endl;
+
+    Datastructures ds;
+    for(std::size_t i = 0; i < towns; ++i){
+        ds.add_town("t" + std::to_string(i), records[i].name, x[i], y[i], 0);
+    }
+    double query = time_per_town([&](){
+        ds.towns_distance_increasing_from(fromX, fromY);
+    }, towns, 3);
+    std::cout << "towns_distance_increasing_from: " << query << " ns/town" << std::endl;
+
+    return 0;
+}
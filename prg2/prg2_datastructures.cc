@@ -2,6 +2,30 @@
 
 #include "datastructures.hh"
 #include <random>
+#include <iterator>
+#include <thread>
+#include <mutex>
+#include <sstream>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <functional>
+#include <fstream>
+#include <condition_variable>
+#include <deque>
+#include <charconv>
+#include <cctype>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 std::minstd_rand rand_engine; // Reasonably quick pseudo-random generator
 
@@ -16,14 +40,375 @@ Type random_in_range(Type start, Type end)
     return static_cast<Type>(start+num);
 }
 
+// Merges that share the work between threads. Ranges shorter than 'threshold' and calls
+// with fewer than two threads use the standard algorithms in the calling thread.
+
+// Merges sorted runs [first1, last1) and [first2, last2) to 'out'. The longer run is cut in
+// the middle and the cut is found from the other run with binary search, so both halves can
+// be merged at the same time. Equal elements of the first run stay first.
+template <typename Iterator, typename Out, typename Less>
+void parallel_merge(Iterator first1, Iterator last1, Iterator first2, Iterator last2, Out out,
+                    Less less, unsigned int threads, std::size_t threshold)
+{
+    std::size_t length1 = last1 - first1;
+    std::size_t length2 = last2 - first2;
+    if(threads < 2 || length1 + length2 < threshold){
+        std::merge(first1, last1, first2, last2, out, less);
+        return;
+    }
+
+    Iterator middle1;
+    Iterator middle2;
+    if(length1 >= length2){
+        middle1 = first1 + length1 / 2;
+        middle2 = std::lower_bound(first2, last2, *middle1, less);
+    } else{
+        middle2 = first2 + length2 / 2;
+        middle1 = std::upper_bound(first1, last1, *middle2, less);
+    }
+    Out middleOut = out + ((middle1 - first1) + (middle2 - first2));
+
+    std::thread left([=](){
+        parallel_merge(first1, middle1, first2, middle2, out, less, threads / 2, threshold);
+    });
+    parallel_merge(middle1, last1, middle2, last2, middleOut, less, threads - threads / 2, threshold);
+    left.join();
+}
+
+// Like std::inplace_merge, but merges to a buffer with parallel_merge and moves the result back.
+template <typename Iterator, typename Less>
+void parallel_inplace_merge(Iterator first, Iterator middle, Iterator last, Less less,
+                            unsigned int threads, std::size_t threshold)
+{
+    if(threads < 2 || std::size_t(last - first) < threshold){
+        std::inplace_merge(first, middle, last, less);
+        return;
+    }
+    std::vector<typename std::iterator_traits<Iterator>::value_type> buffer(last - first);
+    parallel_merge(first, middle, middle, last, buffer.begin(), less, threads, threshold);
+    std::move(buffer.begin(), buffer.end(), first);
+}
+
+// Radix sort for distance orders. A distance and a handle are packed to one 64-bit key whose
+// unsigned order is the order by distance and then by handle, so ties are broken the same way
+// every time and a sort is a few linear passes over contiguous memory.
+
+// Shorter arrays are sorted with std::stable_sort, which is faster for them than counting.
+std::size_t const RADIX_SORT_THRESHOLD = 256;
+
+std::uint64_t distance_key(int distance, std::uint32_t handle)
+{
+    return (std::uint64_t(std::uint32_t(distance) ^ 0x80000000u) << 32) | handle;
+}
+
+std::uint32_t key_handle(std::uint64_t key)
+{
+    return std::uint32_t(key);
+}
+
+// LSD radix sort with 8-bit digits by a 64-bit key of every entry. Counts of all digits are
+// taken in one pass first and digits that are the same in every key are skipped, so the bytes
+// that small distances and handles leave at zero cost nothing. Entries with equal keys keep
+// their order.
+template <typename Entry, typename Key>
+void radix_sort(std::vector<Entry>& entries, Key key)
+{
+    std::size_t const length = entries.size();
+    if(length < RADIX_SORT_THRESHOLD){
+        std::stable_sort(entries.begin(), entries.end(), [&key](Entry const& a, Entry const& b){
+            return key(a) < key(b);
+        });
+        return;
+    }
+
+    std::array<std::array<std::size_t, 256>, 8> counts = {};
+    for(Entry const& entry : entries){
+        std::uint64_t value = key(entry);
+        for(unsigned int digit = 0; digit < 8; ++digit){
+            ++counts[digit][(value >> (8 * digit)) & 0xff];
+        }
+    }
+
+    std::vector<Entry> buffer(length);
+    for(unsigned int digit = 0; digit < 8; ++digit){
+        std::array<std::size_t, 256>& positions = counts[digit];
+        if(positions[(key(entries[0]) >> (8 * digit)) & 0xff] == length){
+            continue;
+        }
+        std::size_t position = 0;
+        for(std::size_t& count : positions){
+            std::size_t next = position + count;
+            count = position;
+            position = next;
+        }
+        for(Entry const& entry : entries){
+            buffer[positions[(key(entry) >> (8 * digit)) & 0xff]++] = entry;
+        }
+        entries.swap(buffer);
+    }
+}
+
+void radix_sort(std::vector<std::uint64_t>& keys)
+{
+    radix_sort(keys, [](std::uint64_t key){
+        return key;
+    });
+}
+
+// String sort for alphabetical orders. Every entry caches 8 bytes of its name as a big-endian
+// number, so comparing the numbers compares the bytes like std::string does and the entries
+// are sorted by them with the radix sort above without touching the names. Only entries whose
+// 8 bytes tie read the next 8 bytes of their names and are sorted again by them, and so on.
+
+std::uint64_t name_prefix(std::string_view name, std::size_t depth)
+{
+    std::uint64_t prefix = 0;
+    for(std::size_t i = depth; i < depth + 8; ++i){
+        prefix = (prefix << 8) | (i < name.size() ? static_cast<unsigned char>(name[i]) : 0);
+    }
+    return prefix;
+}
+
+// Entries in [first, last) have the same first 'depth' bytes and are sorted by their prefixes
+// of the next 8 bytes. Sorts every group of tied prefixes further and gives the group its
+// prefix back afterwards, so entries end up with the prefixes they came with.
+template <typename Iterator, typename Name>
+void sort_prefix_ties(Iterator first, Iterator last, std::size_t depth, Name name)
+{
+    while(first != last){
+        Iterator tie = first + 1;
+        bool longer = name(first->town).size() > depth + 8;
+        while(tie != last && tie->prefix == first->prefix){
+            longer = longer || name(tie->town).size() > depth + 8;
+            ++tie;
+        }
+        if(tie - first > 1){
+            auto prefix_less = [](NameEntry const& a, NameEntry const& b){
+                return a.prefix < b.prefix;
+            };
+            if(longer){
+                std::uint64_t shared = first->prefix;
+                for(Iterator entry = first; entry != tie; ++entry){
+                    entry->prefix = name_prefix(name(entry->town), depth + 8);
+                }
+                std::sort(first, tie, prefix_less);
+                sort_prefix_ties(first, tie, depth + 8, name);
+                for(Iterator entry = first; entry != tie; ++entry){
+                    entry->prefix = shared;
+                }
+            }
+            else{
+                // Names end inside these 8 bytes, so they differ at most by zeros at their ends.
+                std::sort(first, tie, [&name](NameEntry const& a, NameEntry const& b){
+                    return name(a.town).size() < name(b.town).size();
+                });
+            }
+        }
+        first = tie;
+    }
+}
+
+// Sorts towns by the names that name(town) returns.
+template <typename Name>
+void sort_by_name(std::vector<NameEntry>& entries, Name name)
+{
+    for(NameEntry& entry : entries){
+        entry.prefix = name_prefix(name(entry.town), 0);
+    }
+    radix_sort(entries, [](NameEntry const& entry){
+        return entry.prefix;
+    });
+    sort_prefix_ties(entries.begin(), entries.end(), 0, name);
+}
+
+// Binary snapshot files of save_snapshot and load_snapshot. Numbers are in the byte order of
+// the machine that wrote the file, which the loader checks from 'byteOrder'. Towns are in
+// alphabetical order and the position of a town in that order (its rank) stands for the
+// town everywhere in the file. After the header come these sections, each padded with
+// zeros to a multiple of 8 bytes:
+//   offsets of IDs and of names (n+1 uint64 each), characters of IDs, characters of names,
+//   x, y, tax and realm tax (n int32 each),
+//   master, height and deepest vassal (n uint32 each, SNAPSHOT_NONE for no town),
+//   ranks in distance order (n uint32).
+// 'checksum' covers everything after the header.
+static_assert(sizeof(int) == 4, "Snapshot files store int columns as 32-bit values");
+
+namespace
+{
+
+char const SNAPSHOT_MAGIC[8] = {'T', 'O', 'W', 'N', 'S', 'N', 'A', 'P'};
+std::uint32_t const SNAPSHOT_VERSION = 1;
+std::uint32_t const SNAPSHOT_BYTE_ORDER = 0x01020304;
+std::uint32_t const SNAPSHOT_NONE = std::numeric_limits<std::uint32_t>::max();
+
+struct SnapshotHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byteOrder;
+    std::uint64_t towns;
+    std::uint64_t idBytes;
+    std::uint64_t nameBytes;
+    std::uint64_t checksum;
+};
+
+std::uint64_t padded(std::uint64_t bytes)
+{
+    return (bytes + 7) & ~std::uint64_t(7);
+}
+
+// FNV-1a over 64-bit words with an extra shift so that high bits reach low bits too.
+// A last partial word is hashed as if it was padded with zeros like in the file.
+std::uint64_t snapshot_checksum(std::uint64_t hash, unsigned char const* data, std::uint64_t bytes)
+{
+    for(std::uint64_t i = 0; i < bytes; i += 8){
+        std::uint64_t word = 0;
+        std::memcpy(&word, data + i, std::min<std::uint64_t>(8, bytes - i));
+        hash = (hash ^ word) * 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+std::uint64_t const SNAPSHOT_CHECKSUM_START = 0xcbf29ce484222325ULL;
+
+// Writes padded sections after a header and keeps their checksum. Everything goes to a temporary
+// file next to the target, which replaces the target only when all of it has been written, so a
+// failed or interrupted save leaves the previous file as it was.
+class SnapshotWriter
+{
+public:
+    explicit SnapshotWriter(std::string const& path)
+        : path(path), temporaryPath(path + ".tmp"), file(temporaryPath, std::ios::binary | std::ios::trunc)
+    {
+        SnapshotHeader empty = {};
+        file.write(reinterpret_cast<char const*>(&empty), sizeof(empty));
+    }
+
+    SnapshotWriter(SnapshotWriter const&) = delete;
+    SnapshotWriter& operator=(SnapshotWriter const&) = delete;
+
+    ~SnapshotWriter()
+    {
+        if(!finished){
+            file.close();
+            std::remove(temporaryPath.c_str());
+        }
+    }
+
+    void section(void const* data, std::uint64_t bytes)
+    {
+        unsigned char const zeros[8] = {};
+        checksum = snapshot_checksum(checksum, static_cast<unsigned char const*>(data), bytes);
+        file.write(static_cast<char const*>(data), bytes);
+        file.write(reinterpret_cast<char const*>(zeros), padded(bytes) - bytes);
+    }
+
+    template <typename Type>
+    void section(std::vector<Type> const& values)
+    {
+        section(values.data(), values.size() * sizeof(Type));
+    }
+
+    // Writes the header over the placeholder and moves the file over the target. Returns false if any
+    // write failed, and then the target is not touched.
+    bool finish(SnapshotHeader header)
+    {
+        header.checksum = checksum;
+        file.seekp(0);
+        file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+        file.close();
+        if(file.fail()){
+            return false;
+        }
+#if !(defined(__unix__) || defined(__APPLE__))
+        // Rename doesn't replace an existing file everywhere.
+        std::remove(path.c_str());
+#endif
+        finished = std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+        return finished;
+    }
+
+private:
+    std::string path;
+    std::string temporaryPath;
+    std::ofstream file;
+    bool finished = false;
+    std::uint64_t checksum = SNAPSHOT_CHECKSUM_START;
+};
+
+// Read-only view to a whole file. Maps the file to memory where mmap is available, so that
+// pages are read only when they are used, and reads it to a buffer elsewhere.
+class MappedFile
+{
+public:
+    explicit MappedFile(std::string const& path)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        int descriptor = open(path.c_str(), O_RDONLY);
+        if(descriptor == -1){
+            return;
+        }
+        struct stat status;
+        if(fstat(descriptor, &status) == 0 && status.st_size > 0){
+            void* mapping = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+            if(mapping != MAP_FAILED){
+                madvise(mapping, status.st_size, MADV_SEQUENTIAL);
+                bytes = static_cast<unsigned char const*>(mapping);
+                length = status.st_size;
+            }
+        }
+        close(descriptor);
+#else
+        std::ifstream file(path, std::ios::binary);
+        buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        bytes = reinterpret_cast<unsigned char const*>(buffer.data());
+        length = buffer.size();
+#endif
+    }
+
+    ~MappedFile()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        if(bytes != nullptr){
+            munmap(const_cast<unsigned char*>(bytes), length);
+        }
+#endif
+    }
+
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+
+    unsigned char const* data() const { return bytes; }
+    std::uint64_t size() const { return length; }
+
+private:
+    unsigned char const* bytes = nullptr;
+    std::uint64_t length = 0;
+#if !(defined(__unix__) || defined(__APPLE__))
+    std::vector<char> buffer;
+#endif
+};
+
+// Reads value number 'index' of a section. memcpy keeps this legal for any alignment.
+template <typename Type>
+Type snapshot_value(unsigned char const* section, std::uint64_t index)
+{
+    Type value;
+    std::memcpy(&value, section + index * sizeof(Type), sizeof(Type));
+    return value;
+}
+
+}
+
 
 Datastructures::Datastructures()
 {
     TownCount = 0;
-    addedToAplha = 0;
-    addedToDist = 0;
-    minDistance = NO_ID;
-    maxDistance = NO_ID;
+    jumpsValid = false;
+    published = std::make_shared<TownSnapshot const>();
+    mergeThreads = 0;
+    mergeThreshold = PARALLEL_MERGE_THRESHOLD;
 }
 
 Datastructures::~Datastructures()
@@ -33,199 +418,286 @@ Datastructures::~Datastructures()
 
 unsigned int Datastructures::size()
 {
+    STATS_TIMER("size");
     return TownCount;
 }
 
 void Datastructures::clear()
+{
+    STATS_TIMER("clear");
+    clear_towns();
+}
+
+void Datastructures::clear_towns()
 {
     alphabetical.clear();
+    alphabeticalRuns.clear();
     distance.clear();
+    Handles.clear();
     Towns.clear();
+    Columns.clear();
+    spatial.clear();
 
-    addedToAplha = 0;
-    addedToDist = 0;
     TownCount = 0;
 
-    minDistance = NO_ID;
-    maxDistance = NO_ID;
+    jumps.clear();
+    depths.clear();
+    jumpsValid = false;
 }
 
-std::string Datastructures::get_name(TownID id)
+std::string const& Datastructures::get_name(std::string_view id)
 {
-    auto town = Towns.find(id);
-    if(town == Towns.end()){
+    STATS_TIMER("get_name");
+    auto town = Handles.find(id);
+    if(town == Handles.end()){
         return NO_NAME;
     }
-    return town->second->name;
+    return Towns[town->second].name;
 }
 
-std::pair<int, int> Datastructures::get_coordinates(TownID id)
+std::pair<int, int> Datastructures::get_coordinates(std::string_view id)
 {
-    auto town = Towns.find(id);
-    if(town == Towns.end()){
+    STATS_TIMER("get_coordinates");
+    auto town = Handles.find(id);
+    if(town == Handles.end()){
         return {NO_VALUE, NO_VALUE};
     }
-    return {town->second->x, town->second->y};
+    return {Columns.x[town->second], Columns.y[town->second]};
 }
 
-int Datastructures::get_tax(TownID id)
+int Datastructures::get_tax(std::string_view id)
 {
-    auto town = Towns.find(id);
-    if(town == Towns.end()){
+    STATS_TIMER("get_tax");
+    auto town = Handles.find(id);
+    if(town == Handles.end()){
         return NO_VALUE;
     }
-    return town->second->tax;
+    return Columns.tax[town->second];
 }
 
-std::vector<TownID> Datastructures::get_vassals(TownID id)
+std::vector<TownID> Datastructures::get_vassals(std::string_view id)
 {
-    auto town = Towns.find(id);
-    if(town == Towns.end()){
+    STATS_TIMER("get_vassals");
+    auto town = Handles.find(id);
+    if(town == Handles.end()){
         return {NO_ID};
     }
 
-    if(Towns[id]->vassals.size() > 1){
-        std::sort(Towns[id]->vassals.begin(), Towns[id]->vassals.end(), [this](TownID a, TownID b){
-            return a < b;
-        });
-    }
+    std::vector<TownID> vassals;
+    vassals.reserve(Towns[town->second].vassals.size());
+    for_each_vassal(id, [&vassals](TownID const& vassal){
+        vassals.push_back(vassal);
+    });
+    std::sort(vassals.begin(), vassals.end());
 
-    return Towns[id]->vassals;
+    return vassals;
 }
 
 std::vector<TownID> Datastructures::all_towns()
 {
-    return alphabetical;
+    STATS_TIMER("all_towns");
+    TownIDRange towns = alphabetical_view();
+    return std::vector<TownID>(towns.begin(), towns.end());
+}
+
+TownIDRange Datastructures::all_towns_view()
+{
+    STATS_TIMER("all_towns_view");
+    return alphabetical_view();
 }
 
 bool Datastructures::add_town(TownID id, const std::string& name, int x, int y, int tax)
 {
-    if(Towns.find(id) == Towns.end()){
-        std::shared_ptr<TownData> town = std::shared_ptr<TownData>(new TownData{name, x, y, std::abs(x) + std::abs(y), tax});
-        Towns[id] = town;
+    STATS_TIMER("add_town");
+    if(Handles.find(id) != Handles.end()){
+        return false;
+    }
 
-        // Determines new minimum distance if necessary
-        if(minDistance == NO_ID){
-            minDistance = id;
-        } else {
-            if(Towns[minDistance]->TownDistance > Towns[id]->TownDistance){
-                minDistance = id;
+    TownHandle town = Towns.create();
+    Towns[town] = TownData{id, name};
+    Columns.set(town, x, y, tax);
+    Columns.count_distances(town, town + 1);
+    Handles[Towns[town].id] = town;
+
+    add_alphabetical_run({{name_prefix(name), town}});
+    distance.insert(Columns.distance[town], town);
+    spatial.insert(town, x, y);
+
+    // New town has no masters, so jump pointers stay valid.
+    if(jumpsValid){
+        if(town >= depths.size()){
+            depths.resize(town + 1);
+            for(std::vector<TownHandle>& level : jumps){
+                level.resize(town + 1);
             }
         }
-
-        // Determines new maximum distance if necessary
-        if(maxDistance == NO_ID){
-            maxDistance = id;
-        } else {
-            if(Towns[maxDistance]->TownDistance < Towns[id]->TownDistance){
-                maxDistance = id;
-            }
+        depths[town] = 0;
+        for(std::vector<TownHandle>& level : jumps){
+            level[town] = NO_HANDLE;
         }
+    }
 
-        alphabetical.push_back(id);
-        distance.push_back(id);
-
-        ++TownCount;
-        ++addedToAplha;
-        ++addedToDist;
+    ++TownCount;
 
-        return true;
-    }
+    return true;
+}
 
-    return false;
+AddTownsResult Datastructures::add_towns(const std::vector<TownRecord>& towns)
+{
+    return add_towns(towns, towns.size());
 }
 
-bool Datastructures::change_town_name(TownID id, const std::string& newname)
+AddTownsResult Datastructures::add_towns(const std::vector<TownRecord>& towns, std::size_t count)
 {
-    auto town = Towns.find(id);
-    if(town == Towns.end()){
-        return false;
+    STATS_TIMER("add_towns");
+    AddTownsResult result;
+    Handles.reserve(Handles.size() + count);
+
+    std::vector<TownHandle> added;
+    added.reserve(count);
+    TownHandle first = NO_HANDLE;
+    TownHandle last = 0;
+    for(std::size_t i = 0; i < count; ++i){
+        TownRecord const& record = towns[i];
+        if(Handles.find(record.id) != Handles.end()){
+            result.duplicates.push_back(record.id);
+            continue;
+        }
+        TownHandle town = Towns.create();
+        Towns[town] = TownData{record.id, record.name};
+        Handles.emplace(Towns[town].id, town);
+        if(town >= Columns.x.size()){
+            Columns.reserve(town + count - added.size());
+        }
+        Columns.set(town, record.x, record.y, record.tax);
+        added.push_back(town);
+        first = std::min(first, town);
+        last = std::max(last, town + 1);
     }
+    if(added.empty()){
+        return result;
+    }
+    Columns.count_distances(first, last);
 
-    if(alphabetical.size() == 1){
-        town->second->name = newname;
-        return true;
+    // Distance index is built from scratch when it is empty and filled one by one otherwise.
+    if(TownCount == 0){
+        std::vector<std::uint64_t> order;
+        order.reserve(added.size());
+        for(TownHandle town : added){
+            order.push_back(distance_key(Columns.distance[town], town));
+        }
+        radix_sort(order);
+        std::vector<DistanceEntry> entries;
+        entries.reserve(added.size());
+        for(std::uint64_t key : order){
+            TownHandle town = key_handle(key);
+            entries.push_back({Columns.distance[town], town});
+        }
+        distance.build(entries);
+    } else {
+        for(TownHandle town : added){
+            distance.insert(Columns.distance[town], town);
+        }
     }
 
-    // If used ID is in range where alphabetical vector is already sorted, it is fixed to its new place.
-    if(std::binary_search(alphabetical.begin(), alphabetical.end()-addedToAplha, id, [this](TownID a, TownID id){
-                          return Towns[a]->name < Towns[id]->name;})){
-        auto oldPosition = std::lower_bound(alphabetical.begin(), alphabetical.end()-addedToAplha, town->second->name, [this](TownID a, std::string name){
-                return Towns[a]->name < name;
-        });
-        town->second->name = newname;
-        auto newPosition = std::lower_bound(alphabetical.begin(), alphabetical.end()-addedToAplha, newname, [this](TownID a, std::string name){
-                return Towns[a]->name < name;
-        });
+    std::vector<SpatialEntry> entries;
+    entries.reserve(added.size());
+    for(TownHandle town : added){
+        entries.push_back({Columns.x[town], Columns.y[town], town});
+    }
+    spatial.insert_all(std::move(entries));
 
-        if(newPosition < oldPosition){
-            std::rotate(newPosition, oldPosition, oldPosition+1);
-        } else if(newPosition > oldPosition){
-            std::rotate(oldPosition, oldPosition+1, newPosition+1);
-        }
-    } else{
-        town->second->name = newname;
+    std::vector<NameEntry> run;
+    run.reserve(added.size());
+    for(TownHandle town : added){
+        run.push_back({name_prefix(Towns[town].name), town});
     }
-    return true;
+    STATS_ADD(alphabeticalSorts, 1);
+    STATS_ADD(alphabeticalSortedElements, run.size());
+    sort_by_name(run, [this](TownHandle town) -> std::string const& {
+        return Towns[town].name;
+    });
+    add_alphabetical_run(std::move(run));
+    TownCount += added.size();
+    jumpsValid = false;
+
+    result.added = added.size();
+    return result;
 }
 
-bool Datastructures::remove_town(TownID id)
+bool Datastructures::change_town_name(std::string_view id, const std::string& newname)
 {
-    auto town = Towns.find(id);
-    if(town == Towns.end()){
+    STATS_TIMER("change_town_name");
+    auto found = Handles.find(id);
+    if(found == Handles.end()){
         return false;
     }
+    TownHandle town = found->second;
+
+    // Town is fixed to its new place inside the run where it already is.
+    auto [run, oldPosition] = alphabetical_position(town);
+    Towns[town].name = newname;
+    std::uint64_t prefix = name_prefix(newname);
+    oldPosition->prefix = prefix;
+    auto nameLess = [this, prefix](NameEntry const& a, std::string const& name){
+        return name_less(a, name, prefix);
+    };
+    auto newPosition = std::lower_bound(run->begin(), oldPosition, newname, nameLess);
+    if(newPosition != oldPosition){
+        STATS_ADD(alphabeticalShiftedElements, oldPosition - newPosition);
+        std::rotate(newPosition, oldPosition, oldPosition+1);
+    } else {
+        newPosition = std::lower_bound(oldPosition+1, run->end(), newname, nameLess);
+        STATS_ADD(alphabeticalShiftedElements, newPosition - oldPosition - 1);
+        std::rotate(oldPosition, oldPosition+1, newPosition);
+    }
+    return true;
+}
 
-    TownID MastersID = Towns[id]->master;
-    int numberOfVassals = Towns[id]->vassals.size();
-
-    if(MastersID == NO_ID && numberOfVassals > 0){
-        for(int i = 0; i < numberOfVassals; i++){
-            Towns[Towns[id]->vassals[i]]->master = NO_ID;
+bool Datastructures::remove_town(std::string_view id)
+{
+    STATS_TIMER("remove_town");
+    auto found = Handles.find(id);
+    if(found == Handles.end()){
+        return false;
+    }
+    TownHandle town = found->second;
+    TownData& data = Towns[town];
+
+    // Vassals of removed town become vassals of its master. Master gets their tributes
+    // instead of the tribute of removed town.
+    if(data.master != NO_HANDLE){
+        int delta = -(Columns.realmTax[town]/10);
+        for(TownHandle vassal : data.vassals){
+            delta += Columns.realmTax[vassal]/10;
         }
-    } else if(MastersID != NO_ID && numberOfVassals > 0){
-        auto positionInMastersVassals = std::lower_bound(Towns[MastersID]->vassals.begin(), Towns[MastersID]->vassals.end(), id, [this](TownID a, TownID id){
-                return a < id;
-        });
-        Towns[MastersID]->vassals.erase(positionInMastersVassals);
+        update_realm_tax(data.master, delta);
 
-        for(int i = 0; i < numberOfVassals; i++){
-            Towns[Towns[id]->vassals[i]]->master = Towns[id]->master;
-            Towns[Towns[id]->master]->vassals.push_back(Towns[id]->vassals[i]);
-        }
+        std::vector<TownHandle>& mastersVassals = Towns[data.master].vassals;
+        mastersVassals.erase(std::find(mastersVassals.begin(), mastersVassals.end(), town));
     }
-
-    towns_distance_increasing_with_no_return();
-    towns_alphabetically_with_no_return();
-
-    if(id == minDistance){
-        if(TownCount == 1){
-            minDistance = NO_ID;
-        } else {
-            minDistance = NO_ID;
-            minDistance = distance[1];
+    for(TownHandle vassal : data.vassals){
+        Towns[vassal].master = data.master;
+        if(data.master != NO_HANDLE){
+            Towns[data.master].vassals.push_back(vassal);
         }
     }
+    update_height(data.master);
 
-    if(id == maxDistance){
-        if(TownCount == 1){
-            maxDistance = NO_ID;
-        } else {
-            maxDistance = NO_ID;
-            maxDistance = distance[TownCount-2];
-        }
+    auto [run, posAlpha] = alphabetical_position(town);
+    STATS_ADD(alphabeticalShiftedElements, run->end() - posAlpha - 1);
+    run->erase(posAlpha);
+    if(run->empty() && run != &alphabetical){
+        alphabeticalRuns.erase(alphabeticalRuns.begin() + (run - alphabeticalRuns.data()));
     }
 
-    auto posDist = std::lower_bound(distance.begin(), distance.end(), id, [this](TownID a, TownID id){
-            return Towns[a]->TownDistance < Towns[id]->TownDistance;
-    });
-    auto posAlpha = std::lower_bound(alphabetical.begin(), alphabetical.end(), id, [this](TownID a, TownID id){
-            return Towns[a]->name < Towns[id]->name;
-    });
+    distance.erase(Columns.distance[town], town);
+    spatial.erase(town, Columns.x[town], Columns.y[town]);
+    Columns.used[town] = 0;
 
-    alphabetical.erase(posAlpha);
-    distance.erase(posDist);
-    Towns.erase(id);
+    Handles.erase(found);
+    Towns.release(town);
+    jumpsValid = false;
     --TownCount;
 
     return true;
@@ -233,276 +705,2130 @@ bool Datastructures::remove_town(TownID id)
 
 std::vector<TownID> Datastructures::towns_alphabetically()
 {
-    if(addedToAplha == 0){
-        return alphabetical;
-    }
-    else {
-        int sortedUntilIndex = TownCount - addedToAplha;
-        if(sortedUntilIndex == 0){
-            std::sort(alphabetical.begin(), alphabetical.end(), [this](TownID a, TownID b){
-                return Towns[a]->name < Towns[b]->name;
-            });
-        }
-        else{
-            std::sort(alphabetical.begin() + sortedUntilIndex, alphabetical.end(), [this](TownID a, TownID b){
-                return Towns[a]->name < Towns[b]->name;
-            });
-            std::inplace_merge(alphabetical.begin(), alphabetical.begin() + sortedUntilIndex, alphabetical.end());
-        }
-    }
-    addedToAplha = 0;
-    return alphabetical;
+    STATS_TIMER("towns_alphabetically");
+    TownIDRange towns = alphabetical_view();
+    return std::vector<TownID>(towns.begin(), towns.end());
 }
 
-std::vector<TownID> Datastructures::towns_distance_increasing()
+TownIDRange Datastructures::towns_alphabetically_view()
 {
-    if(addedToDist == 0){
-        return distance;
-    }
-    else {
-        int sortedUntilIndex = TownCount - addedToDist;
-        if(sortedUntilIndex == 0){
-            std::sort(distance.begin(), distance.end(), [this](TownID a, TownID b){
-                return Towns[a]->TownDistance < Towns[b]->TownDistance;
-            });
-        }
-        else{
-
-            std::sort(distance.begin() + sortedUntilIndex, distance.end(), [this](TownID a, TownID b){
-                return Towns[a]->TownDistance < Towns[b]->TownDistance;
-            });
-            std::inplace_merge(distance.begin(), distance.begin() + sortedUntilIndex, distance.end());
-        }
-    }
-    addedToDist = 0;
-    return distance;
+    STATS_TIMER("towns_alphabetically_view");
+    return alphabetical_view();
 }
 
-std::vector<TownID> Datastructures::find_towns(std::string const& name)
+std::vector<TownID> Datastructures::towns_distance_increasing()
 {
-
-    towns_alphabetically_with_no_return();
-    std::vector<TownID> foundTowns = {};
-
-    auto lower = std::lower_bound(alphabetical.begin(), alphabetical.end(), name, [this](TownID a, std::string const& name){
-            return Towns[a]->name < name;
+    STATS_TIMER("towns_distance_increasing");
+    std::vector<TownID> towns;
+    towns.reserve(TownCount);
+    for_each_town_distance_increasing([&towns](TownID const& id){
+        towns.push_back(id);
     });
+    return towns;
+}
 
+std::vector<TownID> Datastructures::find_towns(std::string_view name)
+{
+    STATS_TIMER("find_towns");
+    std::vector<TownID> foundTowns = {};
 
-    while(lower != alphabetical.end() && Towns[*lower]->name == name){
-        foundTowns.push_back(*lower);
-        ++lower;
-
-    }
-
-    std::sort(foundTowns.begin(), foundTowns.end(), [this](TownID a, TownID b){
-        return a < b;
-    });
-
+    find_towns(name, std::back_inserter(foundTowns));
+    std::sort(foundTowns.begin(), foundTowns.end());
 
     return foundTowns;
 }
 
 TownID Datastructures::min_distance()
 {
-    return minDistance;
+    STATS_TIMER("min_distance");
+    DistanceEntry const* entry = distance.front();
+    if(entry == nullptr){
+        return NO_ID;
+    }
+    return Towns[entry->town].id;
 }
 
 TownID Datastructures::max_distance()
 {
-    return maxDistance;
+    STATS_TIMER("max_distance");
+    DistanceEntry const* entry = distance.back();
+    if(entry == nullptr){
+        return NO_ID;
+    }
+    return Towns[entry->town].id;
 }
 
 TownID Datastructures::nth_distance(unsigned int n)
 {
+    STATS_TIMER("nth_distance");
     if(TownCount < n || n == 0){
         return NO_ID;
     }
-    towns_distance_increasing_with_no_return();
-    return distance[n - 1];
+    return Towns[distance.nth(n - 1)->town].id;
 }
 
 std::vector<TownID> Datastructures::towns_distance_increasing_from(int x, int y)
 {
-    if(TownCount == 0){
-        return {};
+    STATS_TIMER("towns_distance_increasing_from");
+    std::size_t handles = Columns.x.size();
+    std::vector<int> distances(handles);
+    manhattan_distances(Columns.x.data(), Columns.y.data(), handles, x, y, distances.data());
+
+    std::vector<std::uint64_t> order;
+    order.reserve(TownCount);
+    for(TownHandle town = 0; town < handles; ++town){
+        if(Columns.used[town]){
+            order.push_back(distance_key(distances[town], town));
+        }
     }
-    std::vector<TownID> temp;
-    temp.reserve(TownCount);
-    int dist;
+    radix_sort(order);
 
-    // Get an iterator pointing to begining of map
-    auto it = Towns.begin();
+    std::vector<TownID> towns;
+    towns.reserve(TownCount);
+    for(std::uint64_t key : order){
+        towns.push_back(Towns[key_handle(key)].id);
+    }
 
-    // Iterate over the map using iterator
-    while(it != Towns.end())
-    {
-        dist = std::abs(it->second->x - x) + std::abs(it->second->y - y);
-        it->second->distanceFrom = dist;
-        temp.push_back(it->first);
-        it++;
+    return towns;
+}
+
+std::vector<TownID> Datastructures::nearest_towns(int x, int y, unsigned int k)
+{
+    STATS_TIMER("nearest_towns");
+    std::vector<TownID> towns;
+    towns.reserve(std::min(k, TownCount));
+
+    SpatialIndex::NearestWalk walk = spatial.nearest(x, y);
+    while(towns.size() < k){
+        SpatialEntry const* entry = walk.next();
+        if(entry == nullptr){
+            break;
+        }
+        towns.push_back(Towns[entry->town].id);
     }
 
-    std::sort(temp.begin(), temp.end(), [this](TownID a, TownID b){
-        return Towns[a]->distanceFrom < Towns[b]->distanceFrom;
-    });
+    return towns;
+}
 
-    return temp;
+NearestTowns Datastructures::towns_nearest_first(int x, int y)
+{
+    STATS_TIMER("towns_nearest_first");
+    return NearestTowns(spatial.nearest(x, y), Towns);
 }
 
-bool Datastructures::add_vassalship(TownID vassalid, TownID masterid)
+bool Datastructures::add_vassalship(std::string_view vassalid, std::string_view masterid)
 {
-    auto vassal = Towns.find(vassalid);
-    auto master = Towns.find(masterid);
-    if(vassal == Towns.end() || master == Towns.end() || vassal->second->master != NO_ID){
+    STATS_TIMER("add_vassalship");
+    auto vassal = Handles.find(vassalid);
+    auto master = Handles.find(masterid);
+    if(vassal == Handles.end() || master == Handles.end() || Towns[vassal->second].master != NO_HANDLE){
         return false;
     }
-    vassal->second->master = masterid;
-    master->second->vassals.push_back(vassalid);
+    Towns[vassal->second].master = master->second;
+    Towns[master->second].vassals.push_back(vassal->second);
+    update_realm_tax(master->second, Columns.realmTax[vassal->second]/10);
+    jumpsValid = false;
+
+    // New vassal can only make its masters higher.
+    TownHandle town = vassal->second;
+    TownHandle townsMaster = master->second;
+    while(townsMaster != NO_HANDLE && Towns[town].height + 1 > Towns[townsMaster].height){
+        Towns[townsMaster].height = Towns[town].height + 1;
+        Towns[townsMaster].deepestVassal = town;
+        town = townsMaster;
+        townsMaster = Towns[town].master;
+    }
 
     return true;
 }
 
-std::vector<TownID> Datastructures::taxer_path(TownID id)
+std::vector<TownID> Datastructures::taxer_path(std::string_view id)
 {
-    auto town = Towns.find(id);
-    if(town == Towns.end()){
+    STATS_TIMER("taxer_path");
+    auto town = Handles.find(id);
+    if(town == Handles.end()){
         return {};
     }
 
-    std::vector<TownID> taxPath = {id};
-    TownID masterID = Towns[id]->master;
-
-    while(masterID != NO_ID){
-        taxPath.push_back(masterID);
-        masterID = Towns[masterID]->master;
-    }
-
+    std::vector<TownID> taxPath = {};
+    taxer_path(id, std::back_inserter(taxPath));
     return taxPath;
 }
 
-std::vector<TownID> Datastructures::longest_vassal_path(TownID id)
+std::vector<TownID> Datastructures::find_towns_by_prefix(std::string_view prefix)
 {
+    STATS_TIMER("find_towns_by_prefix");
+    return towns_from_name(prefix, [prefix](std::string const& name){
+        return name.compare(0, prefix.size(), prefix) == 0;
+    });
+}
 
-    auto town = Towns.find(id);
-    if(town == Towns.end()){
-        return {};
-    }
-
-    std::vector<TownID> vassalPath = maxDepth(id);
-
-    return vassalPath;
+std::vector<TownID> Datastructures::towns_in_name_range(std::string_view first, std::string_view last)
+{
+    STATS_TIMER("towns_in_name_range");
+    return towns_from_name(first, [last](std::string const& name){
+        return name < last;
+    });
 }
 
-int Datastructures::total_net_tax(TownID id)
+std::vector<TownID> Datastructures::find_towns_fuzzy(std::string_view name, unsigned int maxEdits)
 {
-    auto town = Towns.find(id);
-    if(town == Towns.end()){
-        return NO_VALUE;
+    STATS_TIMER("find_towns_fuzzy");
+    towns_alphabetically_with_no_return();
+    std::vector<TownID> foundTowns = {};
+    std::size_t const columns = name.size() + 1;
+
+    // rows holds one edit distance row for every prefix length of 'previous' up to 'validRows'.
+    // Next name in order can reuse all rows of the prefix it shares with 'previous'.
+    std::vector<unsigned int> rows(columns);
+    for(std::size_t column = 0; column < columns; ++column){
+        rows[column] = column;
     }
+    std::string_view previous;
+    std::size_t validRows = 0;
+
+    auto town = alphabetical.begin();
+    while(town != alphabetical.end()){
+        std::string_view current = Towns[town->town].name;
+        std::size_t depth = 0;
+        std::size_t limit = std::min({validRows, previous.size(), current.size()});
+        while(depth < limit && previous[depth] == current[depth]){
+            ++depth;
+        }
 
-    std::vector<TownID> vassals = Towns[id]->vassals;
-    TownID master = Towns[id]->master;
-    int taxes = Towns[id]->tax;
-    int numberOfVassals = vassals.size();
+        bool tooFar = false;
+        while(depth < current.size()){
+            rows.resize((depth + 2) * columns);
+            unsigned int* above = &rows[depth * columns];
+            unsigned int* row = &rows[(depth + 1) * columns];
+            row[0] = depth + 1;
+            unsigned int smallest = row[0];
+            for(std::size_t column = 1; column < columns; ++column){
+                unsigned int substitution = above[column - 1] + (name[column - 1] == current[depth] ? 0 : 1);
+                row[column] = std::min({above[column] + 1, row[column - 1] + 1, substitution});
+                smallest = std::min(smallest, row[column]);
+            }
+            ++depth;
+            if(smallest > maxEdits){
+                tooFar = true;
+                break;
+            }
+        }
+        previous = current;
+        validRows = depth;
+
+        if(tooFar){
+            // No name that starts with this prefix can be close enough, so they are all skipped.
+            std::string_view prefix = current.substr(0, depth);
+            town = std::partition_point(town, alphabetical.end(), [this, prefix](NameEntry const& a){
+                    std::string const& other = Towns[a.town].name;
+                    return other < prefix || other.compare(0, prefix.size(), prefix) == 0;
+            });
+            continue;
+        }
 
-    if(numberOfVassals == 0 && master == NO_ID){
-        return taxes;
-    } else if(numberOfVassals == 0 && master != NO_ID){
-        return (taxes-(taxes/10));
-    } else{
-        for(int i = 0; i < numberOfVassals; i++){
-            int returnedTax = taxesOfValssal(vassals[i]);
-            taxes += returnedTax;
+        if(rows[depth * columns + name.size()] <= maxEdits){
+            foundTowns.push_back(Towns[town->town].id);
         }
+        ++town;
     }
 
-    if(master == NO_ID){
-        return taxes;
-    } else{
-        return (taxes-(taxes/10));
-    }
+    return foundTowns;
 }
 
-int Datastructures::taxesOfValssal(TownID id)
+TownID Datastructures::nth_master(std::string_view id, unsigned int k)
 {
-    int taxes = Towns[id]->tax;
-    std::vector<TownID> vassals = Towns[id]->vassals;
-    int numberOfVassals = vassals.size();
-    if(numberOfVassals == 0){
-        return (taxes/10);
+    STATS_TIMER("nth_master");
+    auto town = Handles.find(id);
+    if(town == Handles.end()){
+        return NO_ID;
     }
-    for(int i = 0; i < numberOfVassals; i++){
-        int returnedTax = taxesOfValssal(vassals[i]);
-        taxes += returnedTax;
+
+    build_jumps();
+    TownHandle master = jump(town->second, k);
+    if(master == NO_HANDLE){
+        return NO_ID;
     }
-    return (taxes/10);
+    return Towns[master].id;
 }
 
-std::vector<TownID> Datastructures::maxDepth(TownID id)
+int Datastructures::vassal_depth(std::string_view id)
 {
-    std::vector<TownID> vassalDepth = {id};
-    std::vector<TownID> vassals = Towns[id]->vassals;
-    if(vassals.size() == 0){
-        return vassalDepth;
-    }
-    std::vector<TownID> test = {};
-    int numberOfVassals = vassals.size();
-    for(int i = 0; i < numberOfVassals; i++){
-        std::vector<TownID> returnDepth = maxDepth(vassals[i]);
-        if(returnDepth.size() > test.size()){
-            test = returnDepth;
-        }
+    STATS_TIMER("vassal_depth");
+    auto town = Handles.find(id);
+    if(town == Handles.end()){
+        return NO_VALUE;
     }
 
-    vassalDepth.insert(vassalDepth.end(), test.begin(), test.end());
-
-    return(vassalDepth);
+    build_jumps();
+    return depths[town->second];
 }
 
-void Datastructures::towns_alphabetically_with_no_return()
+TownID Datastructures::common_master(std::string_view id1, std::string_view id2)
 {
-    if(addedToAplha == 0){
-        return;
+    STATS_TIMER("common_master");
+    auto town1 = Handles.find(id1);
+    auto town2 = Handles.find(id2);
+    if(town1 == Handles.end() || town2 == Handles.end()){
+        return NO_ID;
     }
-    else {
-        int sortedUntilIndex = TownCount - addedToAplha;
-        if(sortedUntilIndex == 0){
-            std::sort(alphabetical.begin(), alphabetical.end(), [this](TownID a, TownID b){
-                return Towns[a]->name < Towns[b]->name;
-            });
-        }
-        else{
-            std::sort(alphabetical.begin() + sortedUntilIndex, alphabetical.end(), [this](TownID a, TownID b){
-                return Towns[a]->name < Towns[b]->name;
-            });
-            std::inplace_merge(alphabetical.begin(), alphabetical.begin() + sortedUntilIndex, alphabetical.end());
-        }
+
+    build_jumps();
+    TownHandle a = town1->second;
+    TownHandle b = town2->second;
+    if(depths[a] > depths[b]){
+        a = jump(a, depths[a] - depths[b]);
+    } else {
+        b = jump(b, depths[b] - depths[a]);
     }
-    addedToAplha = 0;
-    return;
+    if(a == b){
+        return Towns[a].id;
+    }
+
+    for(int level = jumps.size() - 1; level >= 0; --level){
+        if(jumps[level][a] != jumps[level][b]){
+            a = jumps[level][a];
+            b = jumps[level][b];
+        }
+    }
+    TownHandle master = Towns[a].master;
+    if(master == NO_HANDLE || master != Towns[b].master){
+        return NO_ID;
+    }
+    return Towns[master].id;
+}
+
+std::vector<TownID> Datastructures::longest_vassal_path(std::string_view id)
+{
+    STATS_TIMER("longest_vassal_path");
+
+    auto town = Handles.find(id);
+    if(town == Handles.end()){
+        return {};
+    }
+
+    std::vector<TownID> vassalPath;
+    vassalPath.reserve(Towns[town->second].height);
+    for(TownHandle vassal = town->second; vassal != NO_HANDLE; vassal = Towns[vassal].deepestVassal){
+        vassalPath.push_back(Towns[vassal].id);
+    }
+
+    return vassalPath;
+}
+
+int Datastructures::total_net_tax(std::string_view id)
+{
+    STATS_TIMER("total_net_tax");
+    auto town = Handles.find(id);
+    if(town == Handles.end()){
+        return NO_VALUE;
+    }
+
+    int taxes = Columns.realmTax[town->second];
+    if(Towns[town->second].master == NO_HANDLE){
+        return taxes;
+    } else{
+        return (taxes-(taxes/10));
+    }
+}
+
+void Datastructures::publish_snapshot()
+{
+    STATS_TIMER("publish_snapshot");
+    towns_alphabetically_with_no_return();
+    auto next = std::make_shared<TownSnapshot>();
+    next->ids.reserve(TownCount);
+    next->names.reserve(TownCount);
+    next->x.reserve(TownCount);
+    next->y.reserve(TownCount);
+    next->tax.reserve(TownCount);
+    next->netTax.reserve(TownCount);
+    next->masters.reserve(TownCount);
+    next->byDistance.reserve(TownCount);
+    next->positions.reserve(TownCount);
+
+    // Position of every handle in the snapshot, so that masters and distance order can be translated.
+    std::vector<unsigned int> positions(Columns.used.size());
+    for(NameEntry const& entry : alphabetical){
+        TownHandle town = entry.town;
+        positions[town] = next->ids.size();
+        next->ids.push_back(Towns[town].id);
+        next->names.push_back(Towns[town].name);
+        next->x.push_back(Columns.x[town]);
+        next->y.push_back(Columns.y[town]);
+        next->tax.push_back(Columns.tax[town]);
+        int taxes = Columns.realmTax[town];
+        next->netTax.push_back(Towns[town].master == NO_HANDLE ? taxes : taxes-(taxes/10));
+    }
+    for(NameEntry const& entry : alphabetical){
+        TownHandle master = Towns[entry.town].master;
+        next->masters.push_back(master == NO_HANDLE ? TownCount : positions[master]);
+    }
+    distance.for_each([&next, &positions](DistanceEntry const& entry){
+        next->byDistance.push_back(positions[entry.town]);
+    });
+    for(unsigned int position = 0; position < next->ids.size(); ++position){
+        next->positions.insert({next->ids[position], position});
+    }
+
+    std::atomic_store(&published, std::shared_ptr<TownSnapshot const>(std::move(next)));
+}
+
+std::shared_ptr<TownSnapshot const> Datastructures::snapshot() const
+{
+    return std::atomic_load(&published);
+}
+
+bool Datastructures::save_snapshot(std::string const& path)
+{
+    STATS_TIMER("save_snapshot");
+    towns_alphabetically_with_no_return();
+    std::size_t towns = alphabetical.size();
+
+    std::vector<std::uint32_t> ranks(Columns.used.size(), SNAPSHOT_NONE);
+    for(std::size_t rank = 0; rank < towns; ++rank){
+        ranks[alphabetical[rank].town] = rank;
+    }
+    auto rank_of = [&ranks](TownHandle town){
+        return town == NO_HANDLE ? SNAPSHOT_NONE : ranks[town];
+    };
+
+    std::vector<std::uint64_t> idOffsets = {0};
+    std::vector<std::uint64_t> nameOffsets = {0};
+    std::string ids;
+    std::string names;
+    std::vector<int> x;
+    std::vector<int> y;
+    std::vector<int> tax;
+    std::vector<int> realmTax;
+    std::vector<std::uint32_t> masters;
+    std::vector<std::uint32_t> heights;
+    std::vector<std::uint32_t> deepest;
+    std::vector<std::uint32_t> byDistance;
+    idOffsets.reserve(towns + 1);
+    nameOffsets.reserve(towns + 1);
+    x.reserve(towns);
+    y.reserve(towns);
+    tax.reserve(towns);
+    realmTax.reserve(towns);
+    masters.reserve(towns);
+    heights.reserve(towns);
+    deepest.reserve(towns);
+    byDistance.reserve(towns);
+
+    for(NameEntry const& entry : alphabetical){
+        TownHandle town = entry.town;
+        TownData const& data = Towns[town];
+        ids += data.id;
+        idOffsets.push_back(ids.size());
+        names += data.name;
+        nameOffsets.push_back(names.size());
+        x.push_back(Columns.x[town]);
+        y.push_back(Columns.y[town]);
+        tax.push_back(Columns.tax[town]);
+        realmTax.push_back(Columns.realmTax[town]);
+        masters.push_back(rank_of(data.master));
+        heights.push_back(data.height);
+        deepest.push_back(rank_of(data.deepestVassal));
+    }
+    distance.for_each([&byDistance, &ranks](DistanceEntry const& entry){
+        byDistance.push_back(ranks[entry.town]);
+    });
+
+    SnapshotWriter writer(path);
+    writer.section(idOffsets);
+    writer.section(nameOffsets);
+    writer.section(ids.data(), ids.size());
+    writer.section(names.data(), names.size());
+    writer.section(x);
+    writer.section(y);
+    writer.section(tax);
+    writer.section(realmTax);
+    writer.section(masters);
+    writer.section(heights);
+    writer.section(deepest);
+    writer.section(byDistance);
+
+    SnapshotHeader header = {};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.towns = towns;
+    header.idBytes = ids.size();
+    header.nameBytes = names.size();
+    return writer.finish(header);
+}
+
+bool Datastructures::load_snapshot(std::string const& path)
+{
+    STATS_TIMER("load_snapshot");
+    MappedFile file(path);
+    SnapshotHeader header;
+    if(file.size() < sizeof(header)){
+        return false;
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    if(std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION
+            || header.byteOrder != SNAPSHOT_BYTE_ORDER){
+        return false;
+    }
+
+    // Sizes are compared to the file before they are used, so a broken header can't cause overflows.
+    std::uint64_t const towns = header.towns;
+    if(towns >= NO_HANDLE || towns > file.size() || header.idBytes > file.size() || header.nameBytes > file.size()){
+        return false;
+    }
+    std::uint64_t offsetBytes = (towns + 1) * sizeof(std::uint64_t);
+    std::uint64_t columnBytes = towns * sizeof(std::uint32_t);
+    std::uint64_t expected = sizeof(header) + 2 * padded(offsetBytes) + padded(header.idBytes)
+            + padded(header.nameBytes) + 8 * padded(columnBytes);
+    if(file.size() != expected){
+        return false;
+    }
+    if(snapshot_checksum(SNAPSHOT_CHECKSUM_START, file.data() + sizeof(header), file.size() - sizeof(header))
+            != header.checksum){
+        return false;
+    }
+
+    unsigned char const* position = file.data() + sizeof(header);
+    auto next_section = [&position](std::uint64_t bytes){
+        unsigned char const* section = position;
+        position += padded(bytes);
+        return section;
+    };
+    unsigned char const* idOffsets = next_section(offsetBytes);
+    unsigned char const* nameOffsets = next_section(offsetBytes);
+    char const* ids = reinterpret_cast<char const*>(next_section(header.idBytes));
+    char const* names = reinterpret_cast<char const*>(next_section(header.nameBytes));
+    unsigned char const* x = next_section(columnBytes);
+    unsigned char const* y = next_section(columnBytes);
+    unsigned char const* tax = next_section(columnBytes);
+    unsigned char const* realmTax = next_section(columnBytes);
+    unsigned char const* masters = next_section(columnBytes);
+    unsigned char const* heights = next_section(columnBytes);
+    unsigned char const* deepest = next_section(columnBytes);
+    unsigned char const* byDistance = next_section(columnBytes);
+
+    // Every town gets its place in distance order as handle, so that the distance index, which breaks ties
+    // by handle, is in the same order as the file.
+    std::vector<TownHandle> handles(towns, NO_HANDLE);
+    for(std::uint64_t place = 0; place < towns; ++place){
+        std::uint32_t rank = snapshot_value<std::uint32_t>(byDistance, place);
+        if(rank >= towns || handles[rank] != NO_HANDLE){
+            return false;
+        }
+        handles[rank] = place;
+    }
+
+    auto text = [](char const* characters, unsigned char const* offsets, std::uint64_t rank){
+        std::uint64_t first = snapshot_value<std::uint64_t>(offsets, rank);
+        return std::string_view(characters + first, snapshot_value<std::uint64_t>(offsets, rank + 1) - first);
+    };
+    auto offsets_valid = [towns](unsigned char const* offsets, std::uint64_t bytes){
+        if(snapshot_value<std::uint64_t>(offsets, 0) != 0 || snapshot_value<std::uint64_t>(offsets, towns) != bytes){
+            return false;
+        }
+        for(std::uint64_t rank = 0; rank < towns; ++rank){
+            if(snapshot_value<std::uint64_t>(offsets, rank) > snapshot_value<std::uint64_t>(offsets, rank + 1)){
+                return false;
+            }
+        }
+        return true;
+    };
+    if(!offsets_valid(idOffsets, header.idBytes) || !offsets_valid(nameOffsets, header.nameBytes)){
+        return false;
+    }
+    for(std::uint64_t rank = 0; rank < towns; ++rank){
+        std::uint32_t master = snapshot_value<std::uint32_t>(masters, rank);
+        std::uint32_t deepestVassal = snapshot_value<std::uint32_t>(deepest, rank);
+        if((master != SNAPSHOT_NONE && master >= towns) || (deepestVassal != SNAPSHOT_NONE && deepestVassal >= towns)
+                || (rank != 0 && text(names, nameOffsets, rank) < text(names, nameOffsets, rank - 1))){
+            return false;
+        }
+    }
+
+    // Heights, deepest vassals and realm taxes in the file are only caches of the master links, so they are
+    // counted again bottom-up like add_vassalship keeps them and the file must agree. A town is counted
+    // when all its vassals are, so towns on a cycle of master links are never counted. Ties between
+    // deepest vassals depend on the order of vassalships, so any vassal on a longest path is accepted.
+    std::vector<std::uint32_t> uncountedVassals(towns, 0);
+    for(std::uint64_t rank = 0; rank < towns; ++rank){
+        std::uint32_t master = snapshot_value<std::uint32_t>(masters, rank);
+        if(master != SNAPSHOT_NONE){
+            ++uncountedVassals[master];
+        }
+    }
+    std::vector<std::uint32_t> countedHeights(towns, 1);
+    std::vector<std::int64_t> countedRealmTaxes(towns);
+    std::vector<std::uint32_t> ready;
+    for(std::uint64_t rank = 0; rank < towns; ++rank){
+        countedRealmTaxes[rank] = snapshot_value<int>(tax, rank);
+        if(uncountedVassals[rank] == 0){
+            ready.push_back(rank);
+        }
+    }
+    std::uint64_t counted = 0;
+    while(!ready.empty()){
+        std::uint32_t rank = ready.back();
+        ready.pop_back();
+        ++counted;
+        std::uint32_t deepestVassal = snapshot_value<std::uint32_t>(deepest, rank);
+        if(countedHeights[rank] != snapshot_value<std::uint32_t>(heights, rank)
+                || countedRealmTaxes[rank] != snapshot_value<int>(realmTax, rank)
+                || (countedHeights[rank] == 1 ? deepestVassal != SNAPSHOT_NONE
+                    : deepestVassal == SNAPSHOT_NONE || snapshot_value<std::uint32_t>(masters, deepestVassal) != rank
+                      || countedHeights[deepestVassal] + 1 != countedHeights[rank])){
+            return false;
+        }
+        std::uint32_t master = snapshot_value<std::uint32_t>(masters, rank);
+        if(master != SNAPSHOT_NONE){
+            countedHeights[master] = std::max(countedHeights[master], countedHeights[rank] + 1);
+            countedRealmTaxes[master] += countedRealmTaxes[rank] / 10;
+            if(--uncountedVassals[master] == 0){
+                ready.push_back(master);
+            }
+        }
+    }
+    if(counted != towns){
+        return false;
+    }
+
+    // New structures are built on the side and moved in only when everything has worked.
+    TownPool newTowns;
+    TownColumns newColumns;
+    std::unordered_map<std::string_view, TownHandle> newHandles;
+    std::vector<NameEntry> newAlphabetical;
+    newColumns.reserve(towns);
+    newHandles.reserve(towns);
+    newAlphabetical.reserve(towns);
+    for(std::uint64_t place = 0; place < towns; ++place){
+        newTowns.create();
+    }
+    for(std::uint64_t rank = 0; rank < towns; ++rank){
+        TownHandle town = handles[rank];
+        TownData& data = newTowns[town];
+        data.id = text(ids, idOffsets, rank);
+        data.name = text(names, nameOffsets, rank);
+        std::uint32_t master = snapshot_value<std::uint32_t>(masters, rank);
+        data.master = master == SNAPSHOT_NONE ? NO_HANDLE : handles[master];
+        data.height = snapshot_value<std::uint32_t>(heights, rank);
+        std::uint32_t deepestVassal = snapshot_value<std::uint32_t>(deepest, rank);
+        data.deepestVassal = deepestVassal == SNAPSHOT_NONE ? NO_HANDLE : handles[deepestVassal];
+        if(!newHandles.emplace(data.id, town).second){
+            return false;
+        }
+
+        newColumns.set(town, snapshot_value<int>(x, rank), snapshot_value<int>(y, rank), snapshot_value<int>(tax, rank));
+        newColumns.realmTax[town] = snapshot_value<int>(realmTax, rank);
+        newAlphabetical.push_back({name_prefix(data.name), town});
+    }
+    for(NameEntry const& entry : newAlphabetical){
+        TownHandle town = entry.town;
+        if(newTowns[town].master != NO_HANDLE){
+            newTowns[newTowns[town].master].vassals.push_back(town);
+        }
+    }
+
+    newColumns.count_distances(0, towns);
+    std::vector<DistanceEntry> distanceEntries;
+    std::vector<SpatialEntry> spatialEntries;
+    distanceEntries.reserve(towns);
+    spatialEntries.reserve(towns);
+    for(TownHandle town = 0; town < towns; ++town){
+        if(town != 0 && newColumns.distance[town] < newColumns.distance[town - 1]){
+            return false;
+        }
+        distanceEntries.push_back({newColumns.distance[town], town});
+        spatialEntries.push_back({newColumns.x[town], newColumns.y[town], town});
+    }
+    DistanceIndex newDistance;
+    newDistance.build(distanceEntries);
+    SpatialIndex newSpatial;
+    newSpatial.insert_all(std::move(spatialEntries));
+
+    clear_towns();
+    Towns = std::move(newTowns);
+    Columns = std::move(newColumns);
+    Handles = std::move(newHandles);
+    alphabetical = std::move(newAlphabetical);
+    distance = std::move(newDistance);
+    spatial = std::move(newSpatial);
+    TownCount = towns;
+    return true;
+}
+
+void Datastructures::set_merge_threads(unsigned int threads, std::size_t threshold)
+{
+    mergeThreads = threads;
+    mergeThreshold = threshold;
+}
+
+unsigned int Datastructures::merge_thread_count() const
+{
+    if(mergeThreads == 0){
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+    return mergeThreads;
+}
+
+std::string Datastructures::dump_stats() const
+{
+#ifdef DATASTRUCTURES_STATS
+    return stats.dump();
+#else
+    return "";
+#endif
+}
+
+void Datastructures::reset_stats()
+{
+#ifdef DATASTRUCTURES_STATS
+    stats.reset();
+#endif
+}
+
+void Datastructures::update_realm_tax(TownHandle town, int delta)
+{
+    while(town != NO_HANDLE && delta != 0){
+        int oldTribute = Columns.realmTax[town]/10;
+        Columns.realmTax[town] += delta;
+        delta = Columns.realmTax[town]/10 - oldTribute;
+        town = Towns[town].master;
+    }
+}
+
+void Datastructures::build_jumps()
+{
+    if(jumpsValid){
+        return;
+    }
+
+    // Depths are counted by going up until a town with known depth is found and then
+    // filling in the towns on the way back down.
+    std::size_t handles = Columns.x.size();
+    STATS_ADD(jumpRebuilds, 1);
+    STATS_ADD(jumpRebuildElements, handles);
+    unsigned int const UNKNOWN = std::numeric_limits<unsigned int>::max();
+    depths.assign(handles, UNKNOWN);
+    unsigned int maxDepth = 0;
+    std::vector<TownHandle> path;
+    for(TownHandle town = 0; town < handles; ++town){
+        if(!Columns.used[town] || depths[town] != UNKNOWN){
+            continue;
+        }
+        TownHandle current = town;
+        while(current != NO_HANDLE && depths[current] == UNKNOWN){
+            path.push_back(current);
+            current = Towns[current].master;
+        }
+        unsigned int depth = current == NO_HANDLE ? 0 : depths[current] + 1;
+        while(!path.empty()){
+            depths[path.back()] = depth;
+            maxDepth = std::max(maxDepth, depth);
+            ++depth;
+            path.pop_back();
+        }
+    }
+
+    unsigned int levels = 1;
+    while((1u << levels) <= maxDepth){
+        ++levels;
+    }
+    jumps.assign(levels, std::vector<TownHandle>(handles, NO_HANDLE));
+    for(TownHandle town = 0; town < handles; ++town){
+        if(Columns.used[town]){
+            jumps[0][town] = Towns[town].master;
+        }
+    }
+    for(unsigned int level = 1; level < levels; ++level){
+        for(TownHandle town = 0; town < handles; ++town){
+            TownHandle half = jumps[level - 1][town];
+            jumps[level][town] = half == NO_HANDLE ? NO_HANDLE : jumps[level - 1][half];
+        }
+    }
+
+    jumpsValid = true;
+}
+
+TownHandle Datastructures::jump(TownHandle town, unsigned int k) const
+{
+    if(k > depths[town]){
+        return NO_HANDLE;
+    }
+    for(unsigned int level = 0; k != 0; ++level, k >>= 1){
+        if(k & 1){
+            town = jumps[level][town];
+        }
+    }
+    return town;
+}
+
+void Datastructures::update_height(TownHandle town)
+{
+    while(town != NO_HANDLE){
+        TownData& data = Towns[town];
+        unsigned int height = 1;
+        TownHandle deepestVassal = NO_HANDLE;
+        for(TownHandle vassal : data.vassals){
+            if(Towns[vassal].height + 1 > height){
+                height = Towns[vassal].height + 1;
+                deepestVassal = vassal;
+            }
+        }
+        if(height == data.height && deepestVassal == data.deepestVassal){
+            return;
+        }
+        data.height = height;
+        data.deepestVassal = deepestVassal;
+        town = data.master;
+    }
+}
+
+std::vector<NameEntry>& Datastructures::alphabetical_run(std::size_t run)
+{
+    return run == 0 ? alphabetical : alphabeticalRuns[run - 1];
+}
+
+std::pair<std::vector<NameEntry>*, std::vector<NameEntry>::iterator> Datastructures::alphabetical_position(TownHandle town)
+{
+    std::string const& name = Towns[town].name;
+    std::uint64_t prefix = name_prefix(name);
+    for(std::size_t run = 0; run <= alphabeticalRuns.size(); ++run){
+        std::vector<NameEntry>& entries = alphabetical_run(run);
+        auto position = std::lower_bound(entries.begin(), entries.end(), name, [this, prefix](NameEntry const& a, std::string const& name){
+                return name_less(a, name, prefix);
+        });
+        while(position != entries.end() && position->prefix == prefix && Towns[position->town].name == name){
+            if(position->town == town){
+                return {&entries, position};
+            }
+            ++position;
+        }
+    }
+    return {&alphabetical, alphabetical.end()};
+}
+
+bool Datastructures::name_less(NameEntry const& a, NameEntry const& b) const
+{
+    return a.prefix < b.prefix || (a.prefix == b.prefix && Towns[a.town].name < Towns[b.town].name);
+}
+
+bool Datastructures::name_less(NameEntry const& a, std::string_view name, std::uint64_t prefix) const
+{
+    return a.prefix < prefix || (a.prefix == prefix && Towns[a.town].name < name);
+}
+
+void Datastructures::add_alphabetical_run(std::vector<NameEntry> run)
+{
+    alphabeticalRuns.push_back(std::move(run));
+    while(!alphabeticalRuns.empty()){
+        std::vector<NameEntry>& newest = alphabeticalRuns.back();
+        std::vector<NameEntry>& older = alphabeticalRuns.size() == 1 ? alphabetical : alphabeticalRuns[alphabeticalRuns.size() - 2];
+        if(newest.size() * 2 <= older.size()){
+            return;
+        }
+        merge_alphabetical_runs(older, newest);
+        alphabeticalRuns.pop_back();
+    }
+}
+
+void Datastructures::merge_alphabetical_runs(std::vector<NameEntry>& older, std::vector<NameEntry>& newer)
+{
+    if(older.empty()){
+        older.swap(newer);
+        return;
+    }
+    STATS_ADD(alphabeticalMergedElements, older.size() + newer.size());
+    std::size_t middle = older.size();
+    older.insert(older.end(), newer.begin(), newer.end());
+    // Most merges are small, so hardware threads are only asked for when the merge may use them.
+    unsigned int threads = older.size() < mergeThreshold ? 1 : merge_thread_count();
+    parallel_inplace_merge(older.begin(), older.begin() + middle, older.end(), [this](NameEntry const& a, NameEntry const& b){
+        return name_less(a, b);
+    }, threads, mergeThreshold);
+}
+
+template <typename Inside>
+std::vector<TownID> Datastructures::towns_from_name(std::string_view first, Inside inside)
+{
+    // Every run gives a sorted range of entries and ranges are merged as they are added.
+    std::uint64_t prefix = name_prefix(first);
+    std::vector<NameEntry> found;
+    for(std::size_t run = 0; run <= alphabeticalRuns.size(); ++run){
+        std::vector<NameEntry> const& entries = alphabetical_run(run);
+        auto town = std::lower_bound(entries.begin(), entries.end(), first, [this, prefix](NameEntry const& a, std::string_view name){
+                return name_less(a, name, prefix);
+        });
+        std::size_t middle = found.size();
+        for(; town != entries.end() && inside(Towns[town->town].name); ++town){
+            found.push_back(*town);
+        }
+        if(middle != 0 && middle != found.size()){
+            std::inplace_merge(found.begin(), found.begin() + middle, found.end(), [this](NameEntry const& a, NameEntry const& b){
+                return name_less(a, b);
+            });
+        }
+    }
+
+    std::vector<TownID> foundTowns;
+    foundTowns.reserve(found.size());
+    for(NameEntry const& entry : found){
+        foundTowns.push_back(Towns[entry.town].id);
+    }
+    return foundTowns;
+}
+
+void Datastructures::towns_alphabetically_with_no_return()
+{
+    // Newest runs are the smallest, so merging from the end moves every town O(1) times.
+    while(!alphabeticalRuns.empty()){
+        std::vector<NameEntry>& older = alphabeticalRuns.size() == 1 ? alphabetical : alphabeticalRuns[alphabeticalRuns.size() - 2];
+        merge_alphabetical_runs(older, alphabeticalRuns.back());
+        alphabeticalRuns.pop_back();
+    }
+}
+
+TownIDRange Datastructures::alphabetical_view()
+{
+    towns_alphabetically_with_no_return();
+    return TownIDRange(alphabetical.data(), alphabetical.data() + alphabetical.size(), &Towns);
+}
+
+void TownColumns::set(TownHandle town, int x, int y, int tax)
+{
+    if(town >= this->x.size()){
+        this->x.resize(town + 1);
+        this->y.resize(town + 1);
+        this->tax.resize(town + 1);
+        realmTax.resize(town + 1);
+        distance.resize(town + 1);
+        used.resize(town + 1);
+    }
+    this->x[town] = x;
+    this->y[town] = y;
+    this->tax[town] = tax;
+    realmTax[town] = tax;
+    used[town] = 1;
+}
+
+void TownColumns::count_distances(TownHandle first, TownHandle last)
+{
+    manhattan_distances(x.data() + first, y.data() + first, last - first, 0, 0, distance.data() + first);
+}
+
+void TownColumns::reserve(std::size_t towns)
+{
+    x.reserve(towns);
+    y.reserve(towns);
+    tax.reserve(towns);
+    realmTax.reserve(towns);
+    distance.reserve(towns);
+    used.reserve(towns);
+}
+
+void TownColumns::clear()
+{
+    x.clear();
+    y.clear();
+    tax.clear();
+    realmTax.clear();
+    distance.clear();
+    used.clear();
+}
+
+void manhattan_distances(int const* x, int const* y, std::size_t n, int fromX, int fromY, int* distances)
+{
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    __m256i const fromX8 = _mm256_set1_epi32(fromX);
+    __m256i const fromY8 = _mm256_set1_epi32(fromY);
+    for(; i + 8 <= n; i += 8){
+        __m256i dx = _mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(x + i)), fromX8);
+        __m256i dy = _mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(y + i)), fromY8);
+        __m256i sum = _mm256_add_epi32(_mm256_abs_epi32(dx), _mm256_abs_epi32(dy));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(distances + i), sum);
+    }
+#elif defined(__SSE2__)
+    // SSE2 has no absolute value for integers, so it is done with sign masks.
+    __m128i const fromX4 = _mm_set1_epi32(fromX);
+    __m128i const fromY4 = _mm_set1_epi32(fromY);
+    for(; i + 4 <= n; i += 4){
+        __m128i dx = _mm_sub_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(x + i)), fromX4);
+        __m128i dy = _mm_sub_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(y + i)), fromY4);
+        __m128i signX = _mm_srai_epi32(dx, 31);
+        __m128i signY = _mm_srai_epi32(dy, 31);
+        dx = _mm_sub_epi32(_mm_xor_si128(dx, signX), signX);
+        dy = _mm_sub_epi32(_mm_xor_si128(dy, signY), signY);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(distances + i), _mm_add_epi32(dx, dy));
+    }
+#endif
+    manhattan_distances_scalar(x + i, y + i, n - i, fromX, fromY, distances + i);
+}
+
+void manhattan_distances_scalar(int const* x, int const* y, std::size_t n, int fromX, int fromY, int* distances)
+{
+    for(std::size_t i = 0; i < n; ++i){
+        distances[i] = std::abs(x[i] - fromX) + std::abs(y[i] - fromY);
+    }
+}
+
+TownPool::TownPool()
+{
+    nextHandle = 0;
+}
+
+TownHandle TownPool::create()
+{
+    if(!freeHandles.empty()){
+        TownHandle town = freeHandles.back();
+        freeHandles.pop_back();
+        return town;
+    }
+    if((nextHandle & (CHUNK_SIZE - 1)) == 0){
+        chunks.push_back(std::unique_ptr<TownData[]>(new TownData[CHUNK_SIZE]));
+    }
+    return nextHandle++;
+}
+
+void TownPool::release(TownHandle town)
+{
+    (*this)[town] = TownData();
+    freeHandles.push_back(town);
+}
+
+void TownPool::clear()
+{
+    chunks.clear();
+    freeHandles.clear();
+    nextHandle = 0;
+}
+
+NearestTowns::NearestTowns(SpatialIndex::NearestWalk walk, const TownPool& towns) :
+    walk(std::move(walk)), towns(towns)
+{
+}
+
+TownID const& NearestTowns::next()
+{
+    SpatialEntry const* entry = walk.next();
+    if(entry == nullptr){
+        return NO_ID;
+    }
+    return towns[entry->town].id;
+}
+
+// Leaves are split when they hold more towns than this.
+unsigned int const BUCKET_SIZE = 16;
+
+// Subtree is rebuilt when one child holds more than this share of its towns. Leaves of one point
+// are left out, and a rebuilt subtree waits until it has grown by half, so towns that share a
+// point can't make every insert rebuild the same subtree again.
+double const BALANCE_LIMIT = 0.75;
+
+SpatialIndex::SpatialIndex()
+{
+    root = -1;
+}
+
+void SpatialIndex::insert(TownHandle town, int x, int y)
+{
+    if(root == -1){
+        root = new_node();
+    }
+
+    // Goes down to the leaf and remembers the highest subtree that got out of balance.
+    int node = root;
+    int unbalanced = -1;
+    while(true){
+        Node& current = nodes[node];
+        ++current.count;
+        if(current.left == -1){
+            if(!current.bucket.empty() && (current.bucket.front().x != x || current.bucket.front().y != y)){
+                current.splittable = true;
+            }
+            current.bucket.push_back({x, y, town});
+            if(unbalanced == -1 && current.count > BUCKET_SIZE && current.splittable){
+                unbalanced = node;
+            }
+            break;
+        }
+
+        int next = (current.onX ? x : y) < current.split ? current.left : current.right;
+        bool stuckLeaf = nodes[next].left == -1 && !nodes[next].splittable;
+        if(unbalanced == -1 && current.count > 2*BUCKET_SIZE && !stuckLeaf &&
+                2 * current.count >= 3 * current.built &&
+                nodes[next].count + 1 > BALANCE_LIMIT * current.count){
+            unbalanced = node;
+        }
+        node = next;
+    }
+
+    if(unbalanced != -1){
+        rebuild(unbalanced);
+    }
+}
+
+bool SpatialIndex::erase(TownHandle town, int x, int y)
+{
+    std::vector<int> path;
+    int node = root;
+    while(node != -1 && nodes[node].left != -1){
+        path.push_back(node);
+        node = (nodes[node].onX ? x : y) < nodes[node].split ? nodes[node].left : nodes[node].right;
+    }
+    if(node == -1){
+        return false;
+    }
+
+    std::vector<SpatialEntry>& bucket = nodes[node].bucket;
+    auto entry = std::find_if(bucket.begin(), bucket.end(), [town](SpatialEntry const& a){
+            return a.town == town;
+    });
+    if(entry == bucket.end()){
+        return false;
+    }
+
+    *entry = std::move(bucket.back());
+    bucket.pop_back();
+    --nodes[node].count;
+    for(int parent : path){
+        --nodes[parent].count;
+    }
+    return true;
+}
+
+void SpatialIndex::insert_all(std::vector<SpatialEntry> entries)
+{
+    if(entries.size() < size()){
+        for(SpatialEntry const& entry : entries){
+            insert(entry.town, entry.x, entry.y);
+        }
+        return;
+    }
+
+    if(root == -1){
+        root = new_node();
+    } else {
+        collect(root, entries);
+    }
+    build(root, entries.begin(), entries.end());
+}
+
+void SpatialIndex::clear()
+{
+    nodes.clear();
+    freeNodes.clear();
+    root = -1;
+}
+
+unsigned int SpatialIndex::size() const
+{
+    return root == -1 ? 0 : nodes[root].count;
+}
+
+SpatialIndex::NearestWalk SpatialIndex::nearest(int x, int y) const
+{
+    return NearestWalk(this, x, y);
+}
+
+int SpatialIndex::new_node()
+{
+    if(!freeNodes.empty()){
+        int node = freeNodes.back();
+        freeNodes.pop_back();
+        nodes[node] = Node();
+        return node;
+    }
+    nodes.push_back(Node());
+    return nodes.size() - 1;
+}
+
+// Moves all entries of a subtree to 'entries' and frees its nodes except the subtree root.
+void SpatialIndex::collect(int node, std::vector<SpatialEntry>& entries)
+{
+    std::vector<int> stack = {node};
+    while(!stack.empty()){
+        int current = stack.back();
+        stack.pop_back();
+
+        std::vector<SpatialEntry>& bucket = nodes[current].bucket;
+        std::move(bucket.begin(), bucket.end(), std::back_inserter(entries));
+        bucket.clear();
+
+        if(nodes[current].left != -1){
+            stack.push_back(nodes[current].left);
+            stack.push_back(nodes[current].right);
+        }
+        if(current != node){
+            freeNodes.push_back(current);
+        }
+    }
+}
+
+// Builds a balanced subtree to 'node' by splitting entries at the median of the wider axis.
+void SpatialIndex::build(int node, std::vector<SpatialEntry>::iterator first, std::vector<SpatialEntry>::iterator last)
+{
+    unsigned int count = last - first;
+    nodes[node].count = count;
+    nodes[node].built = count;
+    nodes[node].left = -1;
+    nodes[node].right = -1;
+    nodes[node].splittable = false;
+
+    if(count > 1){
+        auto xs = std::minmax_element(first, last, [](SpatialEntry const& a, SpatialEntry const& b){
+                return a.x < b.x;
+        });
+        auto ys = std::minmax_element(first, last, [](SpatialEntry const& a, SpatialEntry const& b){
+                return a.y < b.y;
+        });
+        long long spreadX = (long long)xs.second->x - xs.first->x;
+        long long spreadY = (long long)ys.second->y - ys.first->y;
+
+        // If every town is at the same point, they all stay in one leaf.
+        nodes[node].splittable = spreadX != 0 || spreadY != 0;
+        if(count > BUCKET_SIZE && nodes[node].splittable){
+            bool onX = spreadX >= spreadY;
+            auto key = [onX](SpatialEntry const& a){
+                return onX ? a.x : a.y;
+            };
+
+            auto middle = first + count / 2;
+            std::nth_element(first, middle, last, [&key](SpatialEntry const& a, SpatialEntry const& b){
+                    return key(a) < key(b);
+            });
+            int split = key(*middle);
+            if(split == (onX ? xs.first->x : ys.first->y)){
+                // Median equals the minimum, so split just above it instead.
+                split = split + 1;
+            }
+            middle = std::partition(first, last, [&key, split](SpatialEntry const& a){
+                    return key(a) < split;
+            });
+
+            int left = new_node();
+            int right = new_node();
+            nodes[node].split = split;
+            nodes[node].onX = onX;
+            nodes[node].left = left;
+            nodes[node].right = right;
+            build(left, first, middle);
+            build(right, middle, last);
+            return;
+        }
+    }
+
+    nodes[node].bucket.assign(std::make_move_iterator(first), std::make_move_iterator(last));
+}
+
+void SpatialIndex::rebuild(int node)
+{
+    std::vector<SpatialEntry> entries;
+    entries.reserve(nodes[node].count);
+    collect(node, entries);
+    build(node, entries.begin(), entries.end());
+}
+
+SpatialIndex::NearestWalk::NearestWalk(const SpatialIndex* index, int x, int y) :
+    index(index), x(x), y(y)
+{
+    if(index->root != -1){
+        long long const limit = std::numeric_limits<long long>::max() / 4;
+        push_node(index->root, -limit, limit, -limit, limit);
+    }
+}
+
+SpatialEntry const* SpatialIndex::NearestWalk::next()
+{
+    while(!queue.empty()){
+        Item item = queue.top();
+        queue.pop();
+
+        if(item.entry != nullptr){
+            return item.entry;
+        }
+
+        Node const& node = index->nodes[item.node];
+        if(node.left == -1){
+            for(SpatialEntry const& entry : node.bucket){
+                queue.push({std::abs(entry.x - x) + std::abs(entry.y - y), -1, &entry, 0, 0, 0, 0});
+            }
+        } else if(node.onX){
+            push_node(node.left, item.minX, node.split - 1, item.minY, item.maxY);
+            push_node(node.right, node.split, item.maxX, item.minY, item.maxY);
+        } else {
+            push_node(node.left, item.minX, item.maxX, item.minY, node.split - 1);
+            push_node(node.right, item.minX, item.maxX, node.split, item.maxY);
+        }
+    }
+    return nullptr;
+}
+
+// Nodes are queued with the distance from the point to the closest corner of their area.
+void SpatialIndex::NearestWalk::push_node(int node, long long minX, long long maxX, long long minY, long long maxY)
+{
+    if(index->nodes[node].count == 0){
+        return;
+    }
+    long long dx = std::max({minX - x, x - maxX, 0LL});
+    long long dy = std::max({minY - y, y - maxY, 0LL});
+    queue.push({dx + dy, node, nullptr, minX, maxX, minY, maxY});
+}
+
+// Closer items come first. On equal distance towns come before nodes.
+bool SpatialIndex::NearestWalk::Farther::operator()(const Item& a, const Item& b) const
+{
+    if(a.distance != b.distance){
+        return a.distance > b.distance;
+    }
+    return a.entry == nullptr && b.entry != nullptr;
+}
+
+DistanceIndex::DistanceIndex()
+{
+    root = -1;
+    first = -1;
+    last = -1;
+}
+
+void DistanceIndex::insert(int distance, TownHandle town)
+{
+    int node;
+    if(!freeNodes.empty()){
+        node = freeNodes.back();
+        freeNodes.pop_back();
+    } else {
+        nodes.push_back(Node());
+        node = nodes.size() - 1;
+    }
+    nodes[node] = {{distance, town}, static_cast<unsigned int>(priorities()), 1, -1, -1};
+
+    std::pair<int, int> parts = split(root, distance, town);
+    root = merge(merge(parts.first, node), parts.second);
+
+    if(first == -1 || less(distance, town, nodes[first].entry.distance, nodes[first].entry.town)){
+        first = node;
+    }
+    if(last == -1 || less(nodes[last].entry.distance, nodes[last].entry.town, distance, town)){
+        last = node;
+    }
+}
+
+bool DistanceIndex::erase(int distance, TownHandle town)
+{
+    // Goes down to the entry and fixes subtree sizes on the way only if it was found.
+    std::vector<int> path;
+    int* link = &root;
+    while(*link != -1){
+        Node& node = nodes[*link];
+        if(distance == node.entry.distance && town == node.entry.town){
+            break;
+        }
+        path.push_back(*link);
+        link = less(distance, town, node.entry.distance, node.entry.town) ? &node.left : &node.right;
+    }
+    if(*link == -1){
+        return false;
+    }
+
+    int removed = *link;
+    *link = merge(nodes[removed].left, nodes[removed].right);
+    freeNodes.push_back(removed);
+    for(int node : path){
+        --nodes[node].size;
+    }
+    if(removed == first){
+        first = edge(false);
+    }
+    if(removed == last){
+        last = edge(true);
+    }
+    return true;
+}
+
+void DistanceIndex::build(const std::vector<DistanceEntry>& sorted)
+{
+    // Cartesian tree: right edge of the tree is kept in a stack. Subtree size of a node
+    // is final when it leaves the right edge.
+    nodes.reserve(sorted.size());
+    std::vector<int> rightEdge;
+    for(DistanceEntry const& entry : sorted){
+        nodes.push_back({entry, static_cast<unsigned int>(priorities()), 1, -1, -1});
+        int node = nodes.size() - 1;
+
+        int popped = -1;
+        while(!rightEdge.empty() && nodes[rightEdge.back()].priority < nodes[node].priority){
+            popped = rightEdge.back();
+            rightEdge.pop_back();
+            nodes[popped].size = 1 + subtree_size(nodes[popped].left) + subtree_size(nodes[popped].right);
+        }
+        nodes[node].left = popped;
+        if(!rightEdge.empty()){
+            nodes[rightEdge.back()].right = node;
+        }
+        rightEdge.push_back(node);
+    }
+
+    while(!rightEdge.empty()){
+        int top = rightEdge.back();
+        rightEdge.pop_back();
+        nodes[top].size = 1 + subtree_size(nodes[top].left) + subtree_size(nodes[top].right);
+        root = top;
+    }
+    first = edge(false);
+    last = edge(true);
+}
+
+void DistanceIndex::clear()
+{
+    nodes.clear();
+    freeNodes.clear();
+    root = -1;
+    first = -1;
+    last = -1;
+}
+
+unsigned int DistanceIndex::size() const
+{
+    return subtree_size(root);
+}
+
+DistanceEntry const* DistanceIndex::nth(unsigned int n) const
+{
+    int node = root;
+    while(node != -1){
+        unsigned int leftSize = subtree_size(nodes[node].left);
+        if(n < leftSize){
+            node = nodes[node].left;
+        } else if(n == leftSize){
+            return &nodes[node].entry;
+        } else {
+            n -= leftSize + 1;
+            node = nodes[node].right;
+        }
+    }
+    return nullptr;
+}
+
+DistanceEntry const* DistanceIndex::front() const
+{
+    return first == -1 ? nullptr : &nodes[first].entry;
+}
+
+DistanceEntry const* DistanceIndex::back() const
+{
+    return last == -1 ? nullptr : &nodes[last].entry;
+}
+
+bool DistanceIndex::less(int distanceA, TownHandle townA, int distanceB, TownHandle townB)
+{
+    if(distanceA != distanceB){
+        return distanceA < distanceB;
+    }
+    return townA < townB;
+}
+
+unsigned int DistanceIndex::subtree_size(int node) const
+{
+    return node == -1 ? 0 : nodes[node].size;
+}
+
+// Splits subtree to entries smaller than the given key and to the rest.
+std::pair<int, int> DistanceIndex::split(int node, int distance, TownHandle town)
+{
+    if(node == -1){
+        return {-1, -1};
+    }
+    if(less(nodes[node].entry.distance, nodes[node].entry.town, distance, town)){
+        std::pair<int, int> parts = split(nodes[node].right, distance, town);
+        nodes[node].right = parts.first;
+        nodes[node].size = 1 + subtree_size(nodes[node].left) + subtree_size(parts.first);
+        return {node, parts.second};
+    }
+    std::pair<int, int> parts = split(nodes[node].left, distance, town);
+    nodes[node].left = parts.second;
+    nodes[node].size = 1 + subtree_size(parts.second) + subtree_size(nodes[node].right);
+    return {parts.first, node};
+}
+
+// Joins two subtrees when every entry of 'left' is smaller than entries of 'right'.
+int DistanceIndex::merge(int left, int right)
+{
+    if(left == -1){
+        return right;
+    }
+    if(right == -1){
+        return left;
+    }
+    if(nodes[left].priority > nodes[right].priority){
+        nodes[left].right = merge(nodes[left].right, right);
+        nodes[left].size = 1 + subtree_size(nodes[left].left) + subtree_size(nodes[left].right);
+        return left;
+    }
+    nodes[right].left = merge(left, nodes[right].left);
+    nodes[right].size = 1 + subtree_size(nodes[right].left) + subtree_size(nodes[right].right);
+    return right;
+}
+
+int DistanceIndex::edge(bool right) const
+{
+    int node = root;
+    while(node != -1){
+        int next = right ? nodes[node].right : nodes[node].left;
+        if(next == -1){
+            return node;
+        }
+        node = next;
+    }
+    return -1;
+}
+
+unsigned int TownSnapshot::size() const
+{
+    return ids.size();
+}
+
+unsigned int TownSnapshot::position(std::string_view id) const
+{
+    auto town = positions.find(id);
+    if(town == positions.end()){
+        return size();
+    }
+    return town->second;
+}
+
+std::string const& TownSnapshot::get_name(std::string_view id) const
+{
+    unsigned int town = position(id);
+    if(town == size()){
+        return NO_NAME;
+    }
+    return names[town];
+}
+
+std::pair<int, int> TownSnapshot::get_coordinates(std::string_view id) const
+{
+    unsigned int town = position(id);
+    if(town == size()){
+        return {NO_VALUE, NO_VALUE};
+    }
+    return {x[town], y[town]};
+}
+
+int TownSnapshot::get_tax(std::string_view id) const
+{
+    unsigned int town = position(id);
+    if(town == size()){
+        return NO_VALUE;
+    }
+    return tax[town];
+}
+
+std::vector<TownID> const& TownSnapshot::towns_alphabetically() const
+{
+    return ids;
+}
+
+std::vector<TownID> TownSnapshot::towns_distance_increasing() const
+{
+    std::vector<TownID> towns;
+    towns.reserve(size());
+    for(unsigned int town : byDistance){
+        towns.push_back(ids[town]);
+    }
+    return towns;
+}
+
+std::vector<TownID> TownSnapshot::find_towns(std::string_view name) const
+{
+    auto lower = std::lower_bound(names.begin(), names.end(), name);
+    std::vector<TownID> towns;
+    for(auto town = lower; town != names.end() && *town == name; ++town){
+        towns.push_back(ids[town - names.begin()]);
+    }
+    std::sort(towns.begin(), towns.end());
+    return towns;
+}
+
+TownID TownSnapshot::min_distance() const
+{
+    return nth_distance(1);
+}
+
+TownID TownSnapshot::max_distance() const
+{
+    return nth_distance(size());
+}
+
+TownID TownSnapshot::nth_distance(unsigned int n) const
+{
+    if(n == 0 || n > size()){
+        return NO_ID;
+    }
+    return ids[byDistance[n-1]];
+}
+
+std::vector<TownID> TownSnapshot::taxer_path(std::string_view id) const
+{
+    std::vector<TownID> path;
+    for(unsigned int town = position(id); town != size(); town = masters[town]){
+        path.push_back(ids[town]);
+    }
+    return path;
+}
+
+std::vector<TownID> TownSnapshot::towns_distance_increasing_from(int fromX, int fromY) const
+{
+    std::vector<int> distances(size());
+    manhattan_distances(x.data(), y.data(), size(), fromX, fromY, distances.data());
+
+    std::vector<std::uint64_t> order;
+    order.reserve(size());
+    for(unsigned int town = 0; town < size(); ++town){
+        order.push_back(distance_key(distances[town], town));
+    }
+    radix_sort(order);
+
+    std::vector<TownID> towns;
+    towns.reserve(size());
+    for(std::uint64_t key : order){
+        towns.push_back(ids[key_handle(key)]);
+    }
+    return towns;
+}
+
+int TownSnapshot::total_net_tax(std::string_view id) const
+{
+    unsigned int town = position(id);
+    if(town == size()){
+        return NO_VALUE;
+    }
+    return netTax[town];
+}
+
+void LatencyHistogram::record(std::uint64_t nanoseconds)
+{
+    ++buckets[bucket(nanoseconds)];
+    ++total;
+    largest = std::max(largest, nanoseconds);
+}
+
+std::uint64_t LatencyHistogram::count() const
+{
+    return total;
+}
+
+std::uint64_t LatencyHistogram::max() const
+{
+    return largest;
+}
+
+std::uint64_t LatencyHistogram::percentile(double fraction) const
+{
+    std::uint64_t wanted = std::max<std::uint64_t>(1, std::ceil(fraction * total));
+    std::uint64_t seen = 0;
+    for(unsigned int index = 0; index < buckets.size(); ++index){
+        seen += buckets[index];
+        if(seen >= wanted){
+            return std::min(upper_edge(index), largest);
+        }
+    }
+    return largest;
+}
+
+void LatencyHistogram::reset()
+{
+    buckets.fill(0);
+    total = 0;
+    largest = 0;
+}
+
+// Values below SUB_BUCKETS have a bucket each. Bigger values are shifted right until they are
+// between SUB_BUCKETS and 2*SUB_BUCKETS, and the shift picks the group of sub-buckets.
+unsigned int LatencyHistogram::bucket(std::uint64_t value)
+{
+    if(value < SUB_BUCKETS){
+        return value;
+    }
+#if defined(__GNUC__)
+    unsigned int shift = 60 - __builtin_clzll(value);
+#else
+    unsigned int shift = 0;
+    while((value >> shift) >= 2 * SUB_BUCKETS){
+        ++shift;
+    }
+#endif
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+}
+
+std::uint64_t LatencyHistogram::upper_edge(unsigned int bucket)
+{
+    if(bucket < SUB_BUCKETS){
+        return bucket;
+    }
+    unsigned int shift = bucket / SUB_BUCKETS - 1;
+    std::uint64_t lower = std::uint64_t(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    return lower + (std::uint64_t(1) << shift) - 1;
+}
+
+namespace
+{
+// Names are string literals of the call sites, so only pointers are kept.
+std::mutex statsOperationsMutex;
+std::vector<char const*> statsOperations;
+}
+
+std::size_t stats_operation(char const* name)
+{
+    std::lock_guard<std::mutex> lock(statsOperationsMutex);
+    for(std::size_t operation = 0; operation < statsOperations.size(); ++operation){
+        if(std::strcmp(statsOperations[operation], name) == 0){
+            return operation;
+        }
+    }
+    statsOperations.push_back(name);
+    return statsOperations.size() - 1;
+}
+
+char const* stats_operation_name(std::size_t operation)
+{
+    std::lock_guard<std::mutex> lock(statsOperationsMutex);
+    return statsOperations[operation];
+}
+
+StatsTimer::~StatsTimer()
+{
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    if(operation >= stats.operations.size()){
+        stats.operations.resize(operation + 1);
+    }
+    stats.operations[operation].record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+std::string DatastructuresStats::dump() const
+{
+    std::ostringstream out;
+    out << "# TYPE datastructures_calls_total counter\n";
+    for(std::size_t operation = 0; operation < operations.size(); ++operation){
+        if(operations[operation].count() != 0){
+            out << "datastructures_calls_total{operation=\"" << stats_operation_name(operation) << "\"} "
+                << operations[operation].count() << "\n";
+        }
+    }
+
+    out << "# TYPE datastructures_latency_ns summary\n";
+    for(std::size_t operation = 0; operation < operations.size(); ++operation){
+        if(operations[operation].count() == 0){
+            continue;
+        }
+        for(char const* quantile : {"0.5", "0.9", "0.99", "0.999"}){
+            out << "datastructures_latency_ns{operation=\"" << stats_operation_name(operation) << "\",quantile=\""
+                << quantile << "\"} " << operations[operation].percentile(std::stod(quantile)) << "\n";
+        }
+        out << "datastructures_latency_ns_count{operation=\"" << stats_operation_name(operation) << "\"} "
+            << operations[operation].count() << "\n";
+    }
+
+    out << "# TYPE datastructures_latency_max_ns gauge\n";
+    for(std::size_t operation = 0; operation < operations.size(); ++operation){
+        if(operations[operation].count() != 0){
+            out << "datastructures_latency_max_ns{operation=\"" << stats_operation_name(operation) << "\"} "
+                << operations[operation].max() << "\n";
+        }
+    }
+
+    // Lines of the same counter come one after another and share one TYPE line.
+    char const* previous = "";
+    auto counter = [&out, &previous](char const* name, char const* labels, std::uint64_t value){
+        if(std::strcmp(previous, name) != 0){
+            out << "# TYPE " << name << " counter\n";
+            previous = name;
+        }
+        out << name << labels << " " << value << "\n";
+    };
+    counter("datastructures_lazy_sorts_total", "{index=\"alphabetical\"}", alphabeticalSorts);
+    counter("datastructures_lazy_sorted_elements_total", "{index=\"alphabetical\"}", alphabeticalSortedElements);
+    counter("datastructures_lazy_merged_elements_total", "{index=\"alphabetical\"}", alphabeticalMergedElements);
+    counter("datastructures_shifted_elements_total", "{index=\"alphabetical\"}", alphabeticalShiftedElements);
+    counter("datastructures_jump_rebuilds_total", "", jumpRebuilds);
+    counter("datastructures_jump_rebuild_elements_total", "", jumpRebuildElements);
+    return out.str();
+}
+
+void DatastructuresStats::reset()
+{
+    for(LatencyHistogram& histogram : operations){
+        histogram.reset();
+    }
+    alphabeticalSorts = 0;
+    alphabeticalSortedElements = 0;
+    alphabeticalMergedElements = 0;
+    alphabeticalShiftedElements = 0;
+    jumpRebuilds = 0;
+    jumpRebuildElements = 0;
+}
+
+struct TownFileLoader::Chunk
+{
+    enum State { FREE, READ, PARSED };
+
+    State state = FREE;
+    std::uint64_t sequence = 0;
+
+    std::vector<char> text;
+    std::size_t length = 0;
+
+    std::vector<TownRecord> towns;
+    std::vector<std::pair<TownID, TownID>> vassals;
+    std::size_t records = 0;
+    std::uint64_t rejected = 0;
+};
+
+namespace
+{
+
+// Finds the field that starts at 'position' and moves 'position' past the separator after it.
+// Quotes around a field are left out and 'escaped' tells if it has doubled quotes inside.
+bool next_field(std::string_view line, std::size_t& position, char separator, std::string_view& field, bool& escaped)
+{
+    escaped = false;
+    if(position > line.size()){
+        return false;
+    }
+    if(position == line.size() || line[position] != '"'){
+        std::size_t end = std::min(line.find(separator, position), line.size());
+        field = line.substr(position, end - position);
+        position = end + 1;
+        return true;
+    }
+
+    std::size_t first = position + 1;
+    std::size_t quote = line.find('"', first);
+    while(quote != std::string_view::npos && quote + 1 < line.size() && line[quote + 1] == '"'){
+        escaped = true;
+        quote = line.find('"', quote + 2);
+    }
+    if(quote == std::string_view::npos || (quote + 1 < line.size() && line[quote + 1] != separator)){
+        return false;
+    }
+    field = line.substr(first, quote - first);
+    position = quote + 2;
+    return true;
 }
 
-void Datastructures::towns_distance_increasing_with_no_return()
+// Copies a field to a string, which keeps its memory for the next record.
+void assign_field(std::string& to, std::string_view field, bool escaped)
 {
-    if(addedToDist == 0){
+    if(!escaped){
+        to.assign(field.data(), field.size());
         return;
     }
-    else {
-        int sortedUntilIndex = TownCount - addedToDist;
-        if(sortedUntilIndex == 0){
-            std::sort(distance.begin(), distance.end(), [this](TownID a, TownID b){
-                return Towns[a]->TownDistance < Towns[b]->TownDistance;
-            });
+    to.clear();
+    for(std::size_t i = 0; i < field.size(); ++i){
+        to.push_back(field[i]);
+        if(field[i] == '"'){
+            ++i;
+        }
+    }
+}
+
+bool parse_int(std::string_view field, int& value)
+{
+    auto result = std::from_chars(field.data(), field.data() + field.size(), value);
+    return result.ec == std::errc() && result.ptr == field.data() + field.size();
+}
+
+// Names a header may give to each column, without case and underscores.
+std::vector<std::vector<std::string_view>> const TOWN_COLUMNS = {{"id", "townid"}, {"name"}, {"x"}, {"y"}, {"tax"}};
+std::vector<std::vector<std::string_view>> const VASSAL_COLUMNS = {{"vassal", "vassalid"}, {"master", "masterid"}};
+
+bool column_name_is(std::string_view field, std::vector<std::string_view> const& names)
+{
+    std::string name;
+    for(char c : field){
+        if(c != '_'){
+            name.push_back(std::tolower(static_cast<unsigned char>(c)));
+        }
+    }
+    return std::find(names.begin(), names.end(), name) != names.end();
+}
+
+// Tells if a line has exactly the known column names of the file.
+bool is_header(std::string_view line, char separator, bool vassals)
+{
+    std::size_t position = 0;
+    std::string_view field;
+    bool escaped;
+    for(auto const& names : vassals ? VASSAL_COLUMNS : TOWN_COLUMNS){
+        if(!next_field(line, position, separator, field, escaped) || !column_name_is(field, names)){
+            return false;
+        }
+    }
+    return position > line.size();
+}
+
+}
+
+TownFileLoader::TownFileLoader(Datastructures& target, unsigned int workers, std::size_t chunkBytes) :
+    target(target), workers(workers), chunkBytes(chunkBytes)
+{
+    if(this->workers == 0){
+        this->workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+LoadReport TownFileLoader::load(std::string const& townsPath, std::string const& vassalsPath)
+{
+    LoadReport report;
+    report.ok = load_file(townsPath, false, report);
+    if(report.ok && !vassalsPath.empty()){
+        report.ok = load_file(vassalsPath, true, report);
+    }
+    return report;
+}
+
+bool TownFileLoader::load_file(std::string const& path, bool vassals, LoadReport& report)
+{
+    std::ifstream file(path, std::ios::binary);
+    if(!file){
+        return false;
+    }
+    using Clock = std::chrono::steady_clock;
+    auto seconds_since = [](Clock::time_point start){
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    };
+
+    // Everything below is shared between the threads and guarded by 'mutex'.
+    std::vector<Chunk> chunks(2 * workers + 2);
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<Chunk*> toParse;
+    bool reading = true;
+    std::uint64_t chunksRead = 0;
+    char separator = ',';
+
+    std::vector<std::thread> parsers;
+    for(unsigned int worker = 0; worker < workers; ++worker){
+        parsers.emplace_back([&](){
+            while(true){
+                Chunk* chunk;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    changed.wait(lock, [&](){ return !toParse.empty() || !reading; });
+                    if(toParse.empty()){
+                        return;
+                    }
+                    chunk = toParse.front();
+                    toParse.pop_front();
+                }
+                auto start = Clock::now();
+                parse(*chunk, separator, vassals);
+                double spent = seconds_since(start);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    chunk->state = Chunk::PARSED;
+                    report.parse.bytes += chunk->length;
+                    report.parse.records += chunk->records;
+                    report.parse.seconds += spent;
+                    report.rejected += chunk->rejected;
+                }
+                changed.notify_all();
+            }
+        });
+    }
+
+    std::thread inserter([&](){
+        for(std::uint64_t next = 0; ; ++next){
+            Chunk* chunk = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&](){
+                    for(Chunk& candidate : chunks){
+                        if(candidate.state == Chunk::PARSED && candidate.sequence == next){
+                            chunk = &candidate;
+                            return true;
+                        }
+                    }
+                    return !reading && next == chunksRead;
+                });
+                if(chunk == nullptr){
+                    return;
+                }
+            }
+
+            auto start = Clock::now();
+            std::uint64_t added = 0;
+            std::uint64_t refused = 0;
+            if(vassals){
+                for(std::size_t i = 0; i < chunk->records; ++i){
+                    if(target.add_vassalship(chunk->vassals[i].first, chunk->vassals[i].second)){
+                        ++added;
+                    } else{
+                        ++refused;
+                    }
+                }
+            } else{
+                AddTownsResult result = target.add_towns(chunk->towns, chunk->records);
+                added = result.added;
+                refused = result.duplicates.size();
+            }
+            double spent = seconds_since(start);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                report.insert.bytes += chunk->length;
+                report.insert.records += chunk->records;
+                report.insert.seconds += spent;
+                if(vassals){
+                    report.vassalships += added;
+                    report.rejected += refused;
+                } else{
+                    report.towns += added;
+                    report.duplicates += refused;
+                }
+                chunk->state = Chunk::FREE;
+            }
+            changed.notify_all();
         }
-        else{
+    });
 
-            std::sort(distance.begin() + sortedUntilIndex, distance.end(), [this](TownID a, TownID b){
-                return Towns[a]->TownDistance < Towns[b]->TownDistance;
+    // Reading happens in this thread. A chunk ends at its last line break and the rest of
+    // the line is carried over to the start of the next chunk.
+    std::vector<char> carry;
+    bool end = false;
+    while(!end){
+        Chunk* chunk = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&](){
+                for(Chunk& candidate : chunks){
+                    if(candidate.state == Chunk::FREE){
+                        chunk = &candidate;
+                        return true;
+                    }
+                }
+                return false;
             });
-            std::inplace_merge(distance.begin(), distance.begin() + sortedUntilIndex, distance.end());
+            chunk->state = Chunk::READ;
+        }
+
+        auto start = Clock::now();
+        std::size_t length = carry.size();
+        std::size_t lineEnd = 0;
+        if(chunk->text.size() < length + chunkBytes){
+            chunk->text.resize(length + chunkBytes);
+        }
+        std::copy(carry.begin(), carry.end(), chunk->text.begin());
+        while(true){
+            if(chunk->text.size() < length + chunkBytes){
+                chunk->text.resize(length + chunkBytes);
+            }
+            file.read(chunk->text.data() + length, chunkBytes);
+            std::size_t got = file.gcount();
+            length += got;
+            if(got < chunkBytes){
+                end = true;
+                lineEnd = length;
+                break;
+            }
+            // A line longer than a chunk makes the chunk grow until the line ends.
+            auto last = std::find(std::make_reverse_iterator(chunk->text.begin() + length),
+                                  std::make_reverse_iterator(chunk->text.begin() + length - got), '\n');
+            if(last != std::make_reverse_iterator(chunk->text.begin() + length - got)){
+                lineEnd = last.base() - chunk->text.begin();
+                break;
+            }
+        }
+        carry.assign(chunk->text.begin() + lineEnd, chunk->text.begin() + length);
+        chunk->length = lineEnd;
+        double spent = seconds_since(start);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(chunksRead == 0){
+                std::string_view text(chunk->text.data(), chunk->length);
+                std::string_view firstLine = text.substr(0, text.find('\n'));
+                separator = firstLine.find('\t') != std::string_view::npos ? '\t' : ',';
+            }
+            chunk->sequence = chunksRead++;
+            toParse.push_back(chunk);
+            report.read.bytes += length - carry.size();
+            report.read.seconds += spent;
+        }
+        changed.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        reading = false;
+    }
+    changed.notify_all();
+    for(std::thread& parser : parsers){
+        parser.join();
+    }
+    inserter.join();
+    report.read.records = report.parse.records;
+    return true;
+}
+
+void TownFileLoader::parse(Chunk& chunk, char separator, bool vassals)
+{
+    chunk.records = 0;
+    chunk.rejected = 0;
+    std::string_view text(chunk.text.data(), chunk.length);
+    std::size_t lineStart = 0;
+    while(lineStart < text.size()){
+        std::size_t lineEnd = std::min(text.find('\n', lineStart), text.size());
+        std::string_view line = text.substr(lineStart, lineEnd - lineStart);
+        bool firstLine = chunk.sequence == 0 && lineStart == 0;
+        lineStart = lineEnd + 1;
+        if(!line.empty() && line.back() == '\r'){
+            line.remove_suffix(1);
+        }
+        if(line.empty() || (firstLine && is_header(line, separator, vassals))){
+            continue;
+        }
+
+        std::size_t position = 0;
+        std::string_view field;
+        bool escaped;
+        bool valid = true;
+        if(vassals){
+            if(chunk.records == chunk.vassals.size()){
+                chunk.vassals.emplace_back();
+            }
+            auto& vassalship = chunk.vassals[chunk.records];
+            valid = next_field(line, position, separator, field, escaped);
+            if(valid){
+                assign_field(vassalship.first, field, escaped);
+                valid = next_field(line, position, separator, field, escaped);
+            }
+            if(valid){
+                assign_field(vassalship.second, field, escaped);
+            }
+        } else{
+            if(chunk.records == chunk.towns.size()){
+                chunk.towns.emplace_back();
+            }
+            TownRecord& town = chunk.towns[chunk.records];
+            valid = next_field(line, position, separator, field, escaped);
+            if(valid){
+                assign_field(town.id, field, escaped);
+                valid = next_field(line, position, separator, field, escaped);
+            }
+            if(valid){
+                assign_field(town.name, field, escaped);
+                valid = next_field(line, position, separator, field, escaped) && parse_int(field, town.x)
+                        && next_field(line, position, separator, field, escaped) && parse_int(field, town.y)
+                        && next_field(line, position, separator, field, escaped) && parse_int(field, town.tax);
+            }
+        }
+
+        // Every field must have been used.
+        if(valid && position > line.size()){
+            ++chunk.records;
+        } else{
+            ++chunk.rejected;
         }
     }
-    addedToDist = 0;
-    return;
 }
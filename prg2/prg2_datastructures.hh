@@ -4,12 +4,19 @@
 #define DATASTRUCTURES_HH
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <utility>
 #include <limits>
 #include <unordered_map>
 #include <memory>
 #include <algorithm>
+#include <queue>
+#include <random>
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <chrono>
 
 // Type for town IDs
 using TownID = std::string;
@@ -23,18 +30,511 @@ int const NO_VALUE = std::numeric_limits<int>::min();
 // Return value for cases where name values were not found
 std::string const NO_NAME = "-- unknown --";
 
+// Ranges shorter than this are merged in one thread even when more are allowed.
+std::size_t const PARALLEL_MERGE_THRESHOLD = 1 << 16;
+
+// Dense number given to every town when it is added. Used everywhere inside
+// Datastructures instead of TownID so that strings are only hashed at the API.
+using TownHandle = unsigned int;
+
+// Handle for cases where there is no town, for example master of a top town
+TownHandle const NO_HANDLE = std::numeric_limits<TownHandle>::max();
+
+// Coordinates, taxes and distances are kept in TownColumns instead of here.
+// 'height' is the number of towns on the longest vassal path starting from this
+// town and 'deepestVassal' is the vassal that path goes through.
 struct TownData
 {
+    TownID id;
+    std::string name;
+    TownHandle master = NO_HANDLE;
+    std::vector<TownHandle> vassals = {};
+    unsigned int height = 1;
+    TownHandle deepestVassal = NO_HANDLE;
+};
+
+// Numbers of every town as separate arrays indexed by handle, so that a pass over
+// coordinates doesn't pull names and vassals to cache. 'used' is 0 for handles
+// that don't belong to any town right now. 'realmTax' is tax of the town plus the
+// tenth that each vassal pays from its own realm tax.
+struct TownColumns
+{
+    std::vector<int> x;
+    std::vector<int> y;
+    std::vector<int> tax;
+    std::vector<int> realmTax;
+    std::vector<int> distance;
+    std::vector<unsigned char> used;
+
+    // Stores numbers of a town. Distance from origin is left for count_distances.
+    void set(TownHandle town, int x, int y, int tax);
+
+    // Counts distances from origin for handles first..last-1 in one pass.
+    void count_distances(TownHandle first, TownHandle last);
+
+    void reserve(std::size_t towns);
+    void clear();
+};
+
+// Writes |x[i]-fromX| + |y[i]-fromY| to distances[i] for n towns. Uses AVX2 or SSE2
+// when the compiler has them enabled and a plain loop for whatever is left over.
+void manhattan_distances(int const* x, int const* y, std::size_t n, int fromX, int fromY, int* distances);
+
+// Same as above with just the plain loop. Kept for comparison in the benchmark.
+void manhattan_distances_scalar(int const* x, int const* y, std::size_t n, int fromX, int fromY, int* distances);
+
+// Owns all TownData records and gives out their handles. Records are made in big
+// chunks instead of one by one, and they never move. Handles of released records
+// are given out again.
+class TownPool
+{
+public:
+    TownPool();
+
+    // Returns handle of an unused record.
+    TownHandle create();
+
+    // Gives record back to the pool for reuse.
+    void release(TownHandle town);
+
+    // Releases all records by freeing whole chunks.
+    void clear();
+
+    TownData& operator[](TownHandle town)
+    {
+        return chunks[town >> CHUNK_BITS][town & (CHUNK_SIZE - 1)];
+    }
+
+    TownData const& operator[](TownHandle town) const
+    {
+        return chunks[town >> CHUNK_BITS][town & (CHUNK_SIZE - 1)];
+    }
+
+private:
+    static unsigned int const CHUNK_BITS = 10;
+    static unsigned int const CHUNK_SIZE = 1 << CHUNK_BITS;
+
+    std::vector<std::unique_ptr<TownData[]>> chunks;
+    TownHandle nextHandle;
+    std::vector<TownHandle> freeHandles;
+};
+
+// One town in the spatial index. Coordinates are copied here so that searches
+// don't need to look anything up from the town storage.
+struct SpatialEntry
+{
+    int x;
+    int y;
+    TownHandle town;
+};
+
+// Bucket k-d tree over town coordinates. Subtrees that get too lopsided are
+// rebuilt (scapegoat style) so depth stays logarithmic also with sorted input.
+class SpatialIndex
+{
+public:
+    SpatialIndex();
+
+    void insert(TownHandle town, int x, int y);
+    bool erase(TownHandle town, int x, int y);
+
+    // Adds many towns at once. If there are at least as many new towns as old ones,
+    // the whole tree is rebuilt balanced instead of inserting one by one.
+    void insert_all(std::vector<SpatialEntry> entries);
+    void clear();
+    unsigned int size() const;
+
+    // Walks towns in increasing Manhattan distance from a point. Work is done
+    // only when next() is called, so reading k towns costs about O(log n + k).
+    // Adding or removing towns invalidates the walk.
+    class NearestWalk
+    {
+    public:
+        NearestWalk(SpatialIndex const* index, int x, int y);
+
+        // Returns next closest town or nullptr when all towns have been walked.
+        SpatialEntry const* next();
+
+    private:
+        struct Item
+        {
+            long long distance;
+            int node;
+            SpatialEntry const* entry;
+            long long minX, maxX, minY, maxY;
+        };
+        struct Farther
+        {
+            bool operator()(Item const& a, Item const& b) const;
+        };
+
+        SpatialIndex const* index;
+        long long x;
+        long long y;
+        std::priority_queue<Item, std::vector<Item>, Farther> queue;
+
+        void push_node(int node, long long minX, long long maxX, long long minY, long long maxY);
+    };
+
+    NearestWalk nearest(int x, int y) const;
+
+private:
+    struct Node
+    {
+        int split = 0;
+        bool onX = true;
+        int left = -1;
+        int right = -1;
+        unsigned int count = 0;
+        // Towns in the subtree when it was last built. It is not rebuilt again before it has grown by half.
+        unsigned int built = 0;
+        // False for leaves whose towns are all at one point, which no split can separate.
+        bool splittable = false;
+        std::vector<SpatialEntry> bucket = {};
+    };
+
+    std::vector<Node> nodes;
+    std::vector<int> freeNodes;
+    int root;
+
+    int new_node();
+    void collect(int node, std::vector<SpatialEntry>& entries);
+    void build(int node, std::vector<SpatialEntry>::iterator first, std::vector<SpatialEntry>::iterator last);
+    void rebuild(int node);
+};
+
+// One town in the distance index.
+struct DistanceEntry
+{
+    int distance;
+    TownHandle town;
+};
+
+// One town in the alphabetical index. 'prefix' holds the first 8 bytes of the name as a
+// big-endian number with zeros after the end of the name, so a smaller prefix always means
+// a smaller name and the name itself is read only when prefixes are equal.
+struct NameEntry
+{
+    std::uint64_t prefix;
+    TownHandle town;
+};
+
+// Bytes depth..depth+7 of name as a prefix of NameEntry.
+std::uint64_t name_prefix(std::string_view name, std::size_t depth = 0);
+
+// Treap of towns ordered by distance and then by handle. Every node knows the size
+// of its subtree, so the n:th town can be found without sorting anything. Smallest and
+// largest nodes are remembered, so both ends are read in O(1) like from a min-max heap.
+class DistanceIndex
+{
+public:
+    DistanceIndex();
+
+    void insert(int distance, TownHandle town);
+    bool erase(int distance, TownHandle town);
+
+    // Builds the treap in linear time from entries that are already in order.
+    // Index must be empty.
+    void build(std::vector<DistanceEntry> const& sorted);
+    void clear();
+    unsigned int size() const;
+
+    // Returns n:th smallest entry counting from 0, or nullptr if there is none.
+    DistanceEntry const* nth(unsigned int n) const;
+
+    // Return smallest and largest entry, or nullptr if index is empty.
+    DistanceEntry const* front() const;
+    DistanceEntry const* back() const;
+
+    // Calls visit for every entry in increasing order. Doesn't allocate anything.
+    template <typename Visit>
+    void for_each(Visit visit) const
+    {
+        visit_subtree(root, visit);
+    }
+
+private:
+    struct Node
+    {
+        DistanceEntry entry;
+        unsigned int priority;
+        unsigned int size;
+        int left;
+        int right;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<int> freeNodes;
+    int root;
+    int first;
+    int last;
+    std::minstd_rand priorities;
+
+    static bool less(int distanceA, TownHandle townA, int distanceB, TownHandle townB);
+    unsigned int subtree_size(int node) const;
+    std::pair<int, int> split(int node, int distance, TownHandle town);
+    int merge(int left, int right);
+
+    // Goes down the left or right edge of the treap to its first or last node.
+    int edge(bool right) const;
+
+    template <typename Visit>
+    void visit_subtree(int node, Visit& visit) const
+    {
+        while(node != -1){
+            visit_subtree(nodes[node].left, visit);
+            visit(nodes[node].entry);
+            node = nodes[node].right;
+        }
+    }
+};
+
+// One town given to add_towns.
+struct TownRecord
+{
+    TownID id;
     std::string name;
     int x;
     int y;
-    int TownDistance;
     int tax;
-    int distanceFrom = 0;
-    TownID master = NO_ID;
-    std::vector<TownID> vassals = {};
 };
 
+// Result of add_towns. IDs that were already in use, also earlier in the same
+// call, are listed in 'duplicates' and those towns are not added.
+struct AddTownsResult
+{
+    unsigned int added = 0;
+    std::vector<TownID> duplicates = {};
+};
+
+// Lazy nearest-first iteration over towns, returned by towns_nearest_first().
+class NearestTowns
+{
+public:
+    NearestTowns(SpatialIndex::NearestWalk walk, TownPool const& towns);
+
+    // Returns next closest town or NO_ID when all towns have been returned.
+    TownID const& next();
+
+private:
+    SpatialIndex::NearestWalk walk;
+    TownPool const& towns;
+};
+
+// Read-only range of town IDs that borrows from an index of Datastructures
+// instead of copying strings. Valid until the next non-const call of Datastructures,
+// as renames and merges of the alphabetical runs move the index too.
+class TownIDRange
+{
+public:
+    class iterator
+    {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = TownID;
+        using difference_type = std::ptrdiff_t;
+        using pointer = TownID const*;
+        using reference = TownID const&;
+
+        iterator(NameEntry const* position, TownPool const* towns) : position(position), towns(towns) {}
+
+        TownID const& operator*() const { return (*towns)[position->town].id; }
+        TownID const* operator->() const { return &(*towns)[position->town].id; }
+        TownID const& operator[](difference_type n) const { return (*towns)[position[n].town].id; }
+        iterator& operator++() { ++position; return *this; }
+        iterator operator++(int) { iterator old = *this; ++position; return old; }
+        iterator& operator--() { --position; return *this; }
+        iterator operator--(int) { iterator old = *this; --position; return old; }
+        iterator& operator+=(difference_type n) { position += n; return *this; }
+        iterator& operator-=(difference_type n) { position -= n; return *this; }
+        iterator operator+(difference_type n) const { return iterator(position + n, towns); }
+        iterator operator-(difference_type n) const { return iterator(position - n, towns); }
+        difference_type operator-(iterator const& other) const { return position - other.position; }
+        bool operator==(iterator const& other) const { return position == other.position; }
+        bool operator!=(iterator const& other) const { return position != other.position; }
+        bool operator<(iterator const& other) const { return position < other.position; }
+
+    private:
+        NameEntry const* position;
+        TownPool const* towns;
+    };
+
+    TownIDRange(NameEntry const* first, NameEntry const* last, TownPool const* towns) :
+        first(first), last(last), towns(towns) {}
+
+    iterator begin() const { return iterator(first, towns); }
+    iterator end() const { return iterator(last, towns); }
+    std::size_t size() const { return last - first; }
+    bool empty() const { return first == last; }
+    TownID const& operator[](std::size_t n) const { return (*towns)[first[n].town].id; }
+
+private:
+    NameEntry const* first;
+    NameEntry const* last;
+    TownPool const* towns;
+};
+
+// Read-only copy of all towns made by Datastructures::publish_snapshot(). Nothing in it
+// changes after it is made and no method writes anywhere, so any number of threads can
+// query the same snapshot while Datastructures itself is being changed.
+class TownSnapshot
+{
+public:
+    TownSnapshot() = default;
+    TownSnapshot(TownSnapshot const&) = delete;
+    TownSnapshot& operator=(TownSnapshot const&) = delete;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Returns size of a vector.
+    unsigned int size() const;
+
+    // Estimate of performance: Θ(1), O(n)
+    // Short rationale for estimate: One find from unordered map.
+    std::string const& get_name(std::string_view id) const;
+
+    // Estimate of performance: Θ(1), O(n)
+    // Short rationale for estimate: One find from unordered map.
+    std::pair<int, int> get_coordinates(std::string_view id) const;
+
+    // Estimate of performance: Θ(1), O(n)
+    // Short rationale for estimate: One find from unordered map.
+    int get_tax(std::string_view id) const;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: IDs are stored in alphabetical order, so they are returned as they are.
+    std::vector<TownID> const& towns_alphabetically() const;
+
+    // Estimate of performance: Θ(n)
+    // Short rationale for estimate: IDs are copied in the stored distance order.
+    std::vector<TownID> towns_distance_increasing() const;
+
+    // Estimate of performance: O(logn + klogk)
+    // Short rationale for estimate: Binary search from the names that are in alphabetical order. The k IDs are
+    // sorted like Datastructures::find_towns sorts them.
+    std::vector<TownID> find_towns(std::string_view name) const;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: First, last and n:th of the stored distance order.
+    TownID min_distance() const;
+    TownID max_distance() const;
+    TownID nth_distance(unsigned int n) const;
+
+    // Estimate of performance: O(d)
+    // Short rationale for estimate: Follows the d masters above the town.
+    std::vector<TownID> taxer_path(std::string_view id) const;
+
+    // Estimate of performance: Θ(n)
+    // Short rationale for estimate: Distances are counted with the vectorized kernel to a buffer of the call and radix
+    // sorted. Ties are in alphabetical order.
+    std::vector<TownID> towns_distance_increasing_from(int x, int y) const;
+
+    // Estimate of performance: Θ(1), O(n)
+    // Short rationale for estimate: Net taxes are counted when the snapshot is made.
+    int total_net_tax(std::string_view id) const;
+
+private:
+    friend class Datastructures;
+
+    // Every column is in alphabetical order of towns, so a position is the same town in all of them.
+    std::vector<TownID> ids;
+    std::vector<std::string> names;
+    std::vector<int> x;
+    std::vector<int> y;
+    std::vector<int> tax;
+    std::vector<int> netTax;
+    std::vector<unsigned int> masters;
+
+    // Positions of towns in distance order.
+    std::vector<unsigned int> byDistance;
+
+    // Position of every ID. Keys point to 'ids', which is why snapshots are never copied.
+    std::unordered_map<std::string_view, unsigned int> positions;
+
+    // Returns position of the town or size() if it is not in the snapshot.
+    unsigned int position(std::string_view id) const;
+};
+
+// Instrumentation is compiled in only when DATASTRUCTURES_STATS is defined, for example
+// with -DDATASTRUCTURES_STATS. Without it the macros below expand to nothing and
+// dump_stats() returns an empty string.
+
+// Latency histogram in the style of HDR histograms. Buckets grow in powers of two and every
+// power of two is split in 8 linear sub-buckets, so a recorded value is known within 12.5 %
+// at any magnitude with a fixed 4 KB of counters.
+class LatencyHistogram
+{
+public:
+    void record(std::uint64_t nanoseconds);
+
+    std::uint64_t count() const;
+    std::uint64_t max() const;
+
+    // Returns upper edge of the bucket that holds the given fraction (0..1) of recorded values.
+    std::uint64_t percentile(double fraction) const;
+
+    void reset();
+
+private:
+    static unsigned int const SUB_BUCKETS = 8;
+
+    std::array<std::uint64_t, 64 * SUB_BUCKETS> buckets = {};
+    std::uint64_t total = 0;
+    std::uint64_t largest = 0;
+
+    static unsigned int bucket(std::uint64_t value);
+    static std::uint64_t upper_edge(unsigned int bucket);
+};
+
+// Returns a number for an operation name. Every call site asks once and keeps the number
+// in a static variable, so the name is looked up only on the first call.
+std::size_t stats_operation(char const* name);
+
+// Name of a number given by stats_operation.
+char const* stats_operation_name(std::size_t operation);
+
+// Calls and latencies of every operation and the work done by lazy index updates.
+struct DatastructuresStats
+{
+    // Latencies indexed by numbers from stats_operation.
+    std::vector<LatencyHistogram> operations;
+
+    std::uint64_t alphabeticalSorts = 0;           // Sorts of new alphabetical runs.
+    std::uint64_t alphabeticalSortedElements = 0;  // New towns sorted by them.
+    std::uint64_t alphabeticalMergedElements = 0;  // Towns merged when runs are merged.
+    std::uint64_t alphabeticalShiftedElements = 0; // Towns moved in the vector by renames and removals.
+    std::uint64_t jumpRebuilds = 0;                // Rebuilds of jump pointers.
+    std::uint64_t jumpRebuildElements = 0;         // Towns gone through by them.
+
+    // Returns everything in Prometheus text format.
+    std::string dump() const;
+
+    void reset();
+};
+
+// Times the enclosing block and records it for the operation when it ends.
+class StatsTimer
+{
+public:
+    StatsTimer(DatastructuresStats& stats, std::size_t operation) :
+        stats(stats), operation(operation), start(std::chrono::steady_clock::now()) {}
+    ~StatsTimer();
+
+private:
+    DatastructuresStats& stats;
+    std::size_t operation;
+    std::chrono::steady_clock::time_point start;
+};
+
+#ifdef DATASTRUCTURES_STATS
+#define STATS_TIMER(name) \
+    static std::size_t const statsOperation = stats_operation(name); \
+    StatsTimer statsTimer(stats, statsOperation)
+#define STATS_ADD(counter, amount) (stats.counter += (amount))
+#else
+#define STATS_TIMER(name)
+#define STATS_ADD(counter, amount)
+#endif
+
 class Datastructures
 {
 public:
@@ -46,124 +546,438 @@ public:
     unsigned int size();
 
     // Estimate of performance: Θ(n)
-    // Short rationale for estimate: Deletes linearly every saved element from 3 different containers.
+    // Short rationale for estimate: Deletes linearly every saved element from the indexes. Town records
+    // are freed a whole chunk at a time.
     void clear();
 
     // Estimate of performance: Θ(n), O(n)
     // Short rationale for estimate: Find for unordered map is constant at average but in worst case it is linear.
-    std::string get_name(TownID id);
+    std::string const& get_name(std::string_view id);
 
     // Estimate of performance: Θ(n), O(n)
     // Short rationale for estimate: Find for unordered map is constant at average but in worst case it is linear.
-    std::pair<int, int> get_coordinates(TownID id);
+    std::pair<int, int> get_coordinates(std::string_view id);
 
     // Estimate of performance: Θ(n), O(n)
     // Short rationale for estimate: Find for unordered map is constant at average but in worst case it is linear.
-    int get_tax(TownID id);
+    int get_tax(std::string_view id);
 
     // Estimate of performance: Θ(nlogn)
     // Short rationale for estimate: This is because vassals need to be sorted before returning them.
-    std::vector<TownID> get_vassals(TownID id);
+    std::vector<TownID> get_vassals(std::string_view id);
 
-    // Estimate of performance: O(1)
-    // Short rationale for estimate: This just returns vector.
+    // Estimate of performance: Θ(k)
+    // Short rationale for estimate: Calls visit for the ID of each direct vassal without sorting them.
+    // Returns false if town is not found.
+    template <typename Visit>
+    bool for_each_vassal(std::string_view id, Visit visit);
+
+    // Estimate of performance: Θ(n)
+    // Short rationale for estimate: IDs are copied from alphabetical vector.
     std::vector<TownID> all_towns();
 
-    // Estimate of performance: Θ(1)
+    // Estimate of performance: O(n), O(1) when alphabetical index is one run
+    // Short rationale for estimate: Merges the runs of alphabetical index to one and returns a view to it
+    // without copying anything.
+    TownIDRange all_towns_view();
+
+    // Estimate of performance: O(logn) amortized
     // Short rationale for estimate: Adds new town and its variables to containers and
-    // modifies already determined variables if necessary.
+    // modifies already determined variables if necessary. The town is a new alphabetical run
+    // of its own and every town is merged O(logn) times before its run is the biggest.
     bool add_town(TownID id, std::string const& name, int x, int y, int tax);
 
-    // Estimate of performance: Θ(nlogn)
-    // Short rationale for estimate: This function uses binary search to find if value is in certain range
-    // and also to find positions.
-    bool change_town_name(TownID id, std::string const& newname);
+    // Estimate of performance: Θ(klogk), O(klogk + n) amortized
+    // Short rationale for estimate: Containers are reserved once and every index is built with one sort
+    // of the k new towns. They are one new alphabetical run, which is merged with the older runs
+    // when it is not smaller than them.
+    AddTownsResult add_towns(std::vector<TownRecord> const& towns);
 
-    // Estimate of performance: Θ(nlogn)
-    // Short rationale for estimate: Uses sort function from stl. If the vector is already sorted,
-    // estimate of performance is O(1).
+    // Same as above for the first 'count' records only, so a caller can keep reusing one vector.
+    AddTownsResult add_towns(std::vector<TownRecord> const& towns, std::size_t count);
+
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: Town is binary searched from every alphabetical run and moved to
+    // its new place inside its own run.
+    bool change_town_name(std::string_view id, std::string const& newname);
+
+    // Estimate of performance: Θ(n)
+    // Short rationale for estimate: Runs of alphabetical index are merged to one and IDs are copied from it.
     std::vector<TownID> towns_alphabetically();
 
-    // Estimate of performance:  Θ(nlogn)
-    // Short rationale for estimate: Uses sort function from stl. If the vector is already sorted,
-    // estimate of performance is O(1).
+    // Estimate of performance: O(n), O(1) when alphabetical index is one run
+    // Short rationale for estimate: Merges like towns_alphabetically() but returns a view to the merged
+    // vector instead of copying IDs.
+    TownIDRange towns_alphabetically_view();
+
+    // Estimate of performance: Θ(n)
+    // Short rationale for estimate: Distance index is always in order, so it is only walked through.
     std::vector<TownID> towns_distance_increasing();
 
-    // Estimate of performance:  Θ(nlogn)
-    // Short rationale for estimate: Vector is sorted at the start of function which causes function to be  Θ(nlogn).
-    std::vector<TownID> find_towns(std::string const& name);
+    // Estimate of performance: Θ(n)
+    // Short rationale for estimate: Calls visit for every town ID in distance order straight from the distance index.
+    template <typename Visit>
+    void for_each_town_distance_increasing(Visit visit);
+
+    // Estimate of performance: O(log²n + klogk)
+    // Short rationale for estimate: Name is binary searched from each of the O(logn) alphabetical runs
+    // and the k found IDs are sorted.
+    std::vector<TownID> find_towns(std::string_view name);
+
+    // Estimate of performance: O(log²n + k)
+    // Short rationale for estimate: Like find_towns but writes the k found IDs to 'out' run by run
+    // instead of sorting them to a new vector.
+    template <typename OutputIterator>
+    OutputIterator find_towns(std::string_view name, OutputIterator out);
 
     // Estimate of performance: O(1)
-    // Short rationale for estimate: Just returns variable that has needed TownID.
+    // Short rationale for estimate: Distance index remembers its smallest entry. Inserts keep it up to date
+    // with one comparison and removing it finds the next one down the left edge in O(logn).
     TownID min_distance();
 
     // Estimate of performance: O(1)
-    // Short rationale for estimate: Just returns variable that has needed TownID.
+    // Short rationale for estimate: Same as min_distance() for the largest entry and the right edge.
     TownID max_distance();
 
-    // Estimate of performance: Θ(nlogn)
-    // Short rationale for estimate: Sorts vector at the start of the function to provide needed distance.
-    // This causes function to be Θ(nlogn).
+    // Estimate of performance: O(logn)
+    // Short rationale for estimate: Subtree sizes of the distance index tell which way to go at every node.
     TownID nth_distance(unsigned int n);
 
-    // Estimate of performance: Θ(1)
+    // Estimate of performance: O(d)
     // Short rationale for estimate: Find functions for unordered map is constant and also adding new values to containsers.
-    bool add_vassalship(TownID vassalid, TownID masterid);
+    // Realm taxes and heights are updated up the d masters above, stopping when they don't change.
+    bool add_vassalship(std::string_view vassalid, std::string_view masterid);
 
     // Estimate of performance: Θ(n)
     // Short rationale for estimate: Linearity depends on the amount of masters. Likely not so heavy function after all.
-    std::vector<TownID> taxer_path(TownID id);
+    std::vector<TownID> taxer_path(std::string_view id);
+
+    // Estimate of performance: Θ(n)
+    // Short rationale for estimate: Like taxer_path but writes IDs to 'out' instead of a new vector.
+    template <typename OutputIterator>
+    OutputIterator taxer_path(std::string_view id, OutputIterator out);
+
+    // Estimate of performance: O(log²n + klogk)
+    // Short rationale for estimate: Binary search to the first name with the prefix in every alphabetical run
+    // and then the matches are read one after another. The k matches of the runs are merged.
+    // Returns IDs of towns whose name starts with prefix in alphabetical order.
+    std::vector<TownID> find_towns_by_prefix(std::string_view prefix);
+
+    // Estimate of performance: O(log²n + klogk)
+    // Short rationale for estimate: Binary search to both ends of the range in every alphabetical run.
+    // The k towns of the runs are merged.
+    // Returns IDs of towns with first <= name < last in alphabetical order.
+    std::vector<TownID> towns_in_name_range(std::string_view first, std::string_view last);
+
+    // Estimate of performance: O(t*m), O(n + t*m) if alphabetical index has several runs
+    // Short rationale for estimate: Runs are merged and sorted names are walked like a trie. Edit distance rows are shared by names
+    // with a common prefix and whole groups of names are skipped with binary search when their prefix is
+    // already too far. t is the number of prefixes visited and m the length of the searched name.
+    // Returns IDs of towns whose name is at most maxEdits insertions, deletions or substitutions away
+    // from name, in alphabetical order.
+    std::vector<TownID> find_towns_fuzzy(std::string_view name, unsigned int maxEdits);
+
+    // Estimate of performance: O(logn), O(nlogn) after vassalships have changed
+    // Short rationale for estimate: Climbs jump pointers of powers of two. Jump pointers are built again
+    // on the first call after add_vassalship, remove_town or add_towns.
+    // Returns k:th master of town (town itself when k is 0) or NO_ID if there is none.
+    TownID nth_master(std::string_view id, unsigned int k);
+
+    // Estimate of performance: O(1), O(nlogn) after vassalships have changed
+    // Short rationale for estimate: Depths are stored with the jump pointers.
+    // Returns how many masters are above the town or NO_VALUE if town is not found.
+    int vassal_depth(std::string_view id);
+
+    // Estimate of performance: O(logn), O(nlogn) after vassalships have changed
+    // Short rationale for estimate: Deeper town is lifted to same depth and then both are lifted with jump
+    // pointers until their masters are the same.
+    // Returns lowest town that is on both taxer paths, or NO_ID if towns are in different realms.
+    TownID common_master(std::string_view id1, std::string_view id2);
 
     // Non-compulsory operations
 
-    // Estimate of performance:  Θ(nlogn)
-    // Short rationale for estimate: Here two vectors are sorted and there is also binary search used three times.
-    bool remove_town(TownID id);
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: Town is binary searched from every alphabetical run
+    // but erasing from its run is linear. Distance index and spatial index removals are O(logn).
+    // Realm taxes and heights of masters are updated in O(depth) steps.
+    bool remove_town(std::string_view id);
 
     // Estimate of performance: Θ(n)
-    // Short rationale for estimate: Linear because new vector is needed to store every element with new distance.
-    // This function also uses sort function for sorting new vector.
+    // Short rationale for estimate: Distances of all towns are counted in one vectorized pass over the coordinate
+    // columns and then radix sorted by distance and handle, which is a few linear passes.
     std::vector<TownID> towns_distance_increasing_from(int x, int y);
 
-    // Estimate of performance: Θ(n^n)
-    // Short rationale for estimate: It seems this functions complexity is Θ(n^n) because every vassal of every master need
-    // to be checked. This function calls new fuction calles maxDepth which recursively goed through all vassals.
-    std::vector<TownID> longest_vassal_path(TownID id);
+    // Estimate of performance: O(logn + klogn)
+    // Short rationale for estimate: Nearest first walk of the spatial index stops after k towns. Only the
+    // nodes close to the point are opened.
+    std::vector<TownID> nearest_towns(int x, int y, unsigned int k);
+
+    // Estimate of performance: O(logn) per returned town
+    // Short rationale for estimate: Returns a lazy walk, so nothing is computed before next() is called.
+    NearestTowns towns_nearest_first(int x, int y);
+
+    // Estimate of performance: Θ(k)
+    // Short rationale for estimate: Every town knows its deepest vassal, so the path of k towns is just
+    // followed down without recursion.
+    std::vector<TownID> longest_vassal_path(std::string_view id);
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Realm tax of every town is kept up to date when vassalships change,
+    // so only the tribute to own master is taken off.
+    int total_net_tax(std::string_view id);
 
-    // Estimate of performance: Θ(n^n)
-    // Short rationale for estimate: Has same complexity as longest_vassal_path for same reasons.
-    // Every vassal of vassals need to be checked for taxes.
-    int total_net_tax(TownID id);
+    // Snapshot operations
+
+    // Estimate of performance: Θ(n)
+    // Short rationale for estimate: Every town is copied to a new snapshot in alphabetical order. The snapshot
+    // replaces the old one with one atomic store, so readers of the old snapshot are not disturbed and it is
+    // freed when the last of them lets go. atomic_store on a shared_ptr takes a short lock inside the standard
+    // library, so it is not lock-free. Only one thread may change Datastructures at a time.
+    void publish_snapshot();
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Atomic load of the latest published snapshot. Safe to call from any thread.
+    // The load takes the same short standard library lock as publish_snapshot() while the pointer is copied.
+    // Queries on the returned snapshot take no locks. The snapshot is empty before the first publish_snapshot()
+    // and doesn't see later changes until republished.
+    std::shared_ptr<TownSnapshot const> snapshot() const;
+
+    // Snapshot files
+
+    // Estimate of performance: Θ(n)
+    // Short rationale for estimate: Towns are written once in alphabetical order together with the distance
+    // order, so nothing has to be sorted when the file is loaded.
+    // Returns false if the file can't be written. The file is written next to path with ".tmp" added and renamed
+    // over path only when complete, so a failed save leaves an earlier file at path as it was.
+    bool save_snapshot(std::string const& path);
+
+    // Estimate of performance: Θ(n), O(nlogn) for the spatial index
+    // Short rationale for estimate: File is mapped to memory and checked in linear passes. Alphabetical vector and
+    // distance index are built from the orders in the file without sorting. Only the k-d tree is built again
+    // with median selection.
+    // Replaces all towns with the ones in the file. Returns false and changes nothing if the file can't be read,
+    // is from another version or byte order, or fails the checksum or consistency checks. Heights, deepest
+    // vassals and realm taxes are counted again from the master links and must match the file.
+    bool load_snapshot(std::string const& path);
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Only stores the settings.
+    // Sets how many threads merging of the alphabetical runs may use. 0 means one for every hardware thread
+    // and 1 turns parallel merging off. Ranges shorter than threshold are always merged in one thread.
+    // New towns are always sorted in the calling thread before they are merged.
+    void set_merge_threads(unsigned int threads, std::size_t threshold = PARALLEL_MERGE_THRESHOLD);
+
+    // Instrumentation
+
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: Goes once through the k operations that have been called.
+    // Returns call counts, latency percentiles and work of lazy index updates in Prometheus text format.
+    // Empty when compiled without DATASTRUCTURES_STATS.
+    std::string dump_stats() const;
+
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: Zeroes the histograms of k operations and all counters.
+    void reset_stats();
 
 private:
 
-    // Vectors for storing towns in alphabetical and distance oreder.
-    std::vector<TownID> alphabetical;
-    std::vector<TownID> distance;
+    // Alphabetical index is a log of sorted runs. 'alphabetical' is the oldest and biggest run and
+    // 'alphabeticalRuns' the newer ones from biggest to smallest. New towns are added as a run and
+    // runs at the end are merged while one is more than half the size of the run before it, so
+    // there are O(logn) runs. Queries that need the whole order merge everything to 'alphabetical'.
+    // Entries carry prefixes of the names, so searches and merges mostly run over the runs alone.
+    std::vector<NameEntry> alphabetical;
+    std::vector<std::vector<NameEntry>> alphabeticalRuns;
+
+    // Towns in distance order. Also gives minimum and maximum distances.
+    DistanceIndex distance;
 
-    // Here are stored all TownIDs with their struct.
-    std::unordered_map<TownID, std::shared_ptr<TownData>> Towns;
+    // Here are stored all TownIDs with the handle of their struct. Keys point to the IDs in
+    // TownPool, which never move, so lookups can be done with string_view.
+    std::unordered_map<std::string_view, TownHandle> Handles;
 
-    // Variables to store amount of added towns after last sorting.
-    int addedToAplha;
-    int addedToDist;
+    // Structs of all towns indexed by handle.
+    TownPool Towns;
+
+    // Coordinates, taxes and distances of all towns indexed by handle.
+    TownColumns Columns;
+
+    // Jump pointers over master links. jumps[j][town] is the 2^j:th master of town and
+    // depths[town] the number of masters above it. Built lazily when jumpsValid is false.
+    std::vector<std::vector<TownHandle>> jumps;
+    std::vector<unsigned int> depths;
+    bool jumpsValid;
 
     // Counts amount of towns.
     unsigned int TownCount;
 
-    // Here are variables for storing minimum and maximum distances.
-    TownID minDistance;
-    TownID maxDistance;
+    // k-d tree of town coordinates for distance-from-point queries.
+    SpatialIndex spatial;
+
+    // Latest snapshot given to readers. Only accessed with atomic_load and atomic_store, which libstdc++
+    // guards with a pool of mutexes.
+    std::shared_ptr<TownSnapshot const> published;
+
+    // Settings given to set_merge_threads.
+    unsigned int mergeThreads;
+    std::size_t mergeThreshold;
+
+    // Returns how many threads a merge may use.
+    unsigned int merge_thread_count() const;
+
+    // Calls, latencies and lazy index work. Updated through STATS_TIMER and STATS_ADD. Declared in
+    // every build so that the class looks the same with and without DATASTRUCTURES_STATS.
+    DatastructuresStats stats;
+
+    // Adds delta to realm tax of town and passes the change of its tribute on to its masters.
+    void update_realm_tax(TownHandle town, int delta);
+
+    // Builds jumps and depths again if vassalships have changed.
+    void build_jumps();
+
+    // Returns k:th master of town or NO_HANDLE. Jumps must be valid.
+    TownHandle jump(TownHandle town, unsigned int k) const;
+
+    // Counts height and deepest vassal of town again from its vassals and continues to its
+    // masters as long as something changes.
+    void update_height(TownHandle town);
+
+    // Returns alphabetical run number 'run'. Run 0 is 'alphabetical'.
+    std::vector<NameEntry>& alphabetical_run(std::size_t run);
+
+    // Returns the run of town and position of town in it. Town must be in the index.
+    std::pair<std::vector<NameEntry>*, std::vector<NameEntry>::iterator> alphabetical_position(TownHandle town);
 
-    // Returns tax from one vassal and it's vassals.
-    int taxesOfValssal(TownID id);
+    // Adds sorted entries as the newest alphabetical run and merges runs to keep their sizes halving.
+    void add_alphabetical_run(std::vector<NameEntry> run);
 
-    // Used in longest_vassal_path. Returns longest depth of vassals in a vector.
-    std::vector<TownID> maxDepth(TownID id);
+    // Merges 'newer' run to the end of 'older' run.
+    void merge_alphabetical_runs(std::vector<NameEntry>& older, std::vector<NameEntry>& newer);
 
-    // These two just sorts vectors 'alphabetical' and 'distance' with no return.
+    // Returns IDs of towns from 'first' onwards in alphabetical order while their names are 'inside'.
+    template <typename Inside>
+    std::vector<TownID> towns_from_name(std::string_view first, Inside inside);
+
+    // Compare towns by name. Prefixes are compared first and names only when they are equal.
+    bool name_less(NameEntry const& a, NameEntry const& b) const;
+    bool name_less(NameEntry const& a, std::string_view name, std::uint64_t prefix) const;
+
+    // This just merges all alphabetical runs to vector 'alphabetical' with no return.
     void towns_alphabetically_with_no_return();
-    void towns_distance_increasing_with_no_return();
+
+    // Merges the runs and returns all towns in alphabetical order. Not timed, so public queries
+    // built on it are counted once in the stats.
+    TownIDRange alphabetical_view();
+
+    // Removes all towns like clear(), but isn't timed, for load_snapshot.
+    void clear_towns();
+};
+
+template <typename Visit>
+void Datastructures::for_each_town_distance_increasing(Visit visit)
+{
+    distance.for_each([this, &visit](DistanceEntry const& entry){
+        visit(Towns[entry.town].id);
+    });
+}
+
+template <typename OutputIterator>
+OutputIterator Datastructures::find_towns(std::string_view name, OutputIterator out)
+{
+    std::uint64_t prefix = name_prefix(name);
+    for(std::size_t run = 0; run <= alphabeticalRuns.size(); ++run){
+        std::vector<NameEntry> const& entries = alphabetical_run(run);
+        auto lower = std::lower_bound(entries.begin(), entries.end(), name, [this, prefix](NameEntry const& a, std::string_view name){
+                return name_less(a, name, prefix);
+        });
+        while(lower != entries.end() && lower->prefix == prefix && Towns[lower->town].name == name){
+            *out++ = Towns[lower->town].id;
+            ++lower;
+        }
+    }
+    return out;
+}
+
+template <typename OutputIterator>
+OutputIterator Datastructures::taxer_path(std::string_view id, OutputIterator out)
+{
+    auto town = Handles.find(id);
+    if(town == Handles.end()){
+        return out;
+    }
+    for(TownHandle master = town->second; master != NO_HANDLE; master = Towns[master].master){
+        *out++ = Towns[master].id;
+    }
+    return out;
+}
+
+template <typename Visit>
+bool Datastructures::for_each_vassal(std::string_view id, Visit visit)
+{
+    auto town = Handles.find(id);
+    if(town == Handles.end()){
+        return false;
+    }
+    for(TownHandle vassal : Towns[town->second].vassals){
+        visit(Towns[vassal].id);
+    }
+    return true;
+}
+
+// Throughput of one stage of TownFileLoader. 'seconds' is the time spent in the stage,
+// summed over its threads.
+struct LoadStage
+{
+    std::uint64_t bytes = 0;
+    std::uint64_t records = 0;
+    double seconds = 0;
+};
+
+// Result of TownFileLoader::load.
+struct LoadReport
+{
+    bool ok = false;               // False if a file couldn't be opened.
+    std::uint64_t towns = 0;       // Towns added.
+    std::uint64_t vassalships = 0; // Vassalships added.
+    std::uint64_t duplicates = 0;  // Towns not added because their ID was already used.
+    std::uint64_t rejected = 0;    // Lines that couldn't be parsed and vassalships that add_vassalship refused.
+    LoadStage read;
+    LoadStage parse;
+    LoadStage insert;
+};
+
+// Streams towns and vassalships from CSV or TSV files to Datastructures. The calling thread
+// reads the file in chunks that end at a line break, worker threads parse chunks to batches of
+// records and one thread inserts the batches in file order. The same few chunks are used over
+// and over, so memory use doesn't depend on file size and records reuse the memory of their
+// strings from chunk to chunk.
+// Town lines are "id,name,x,y,tax" and vassal lines "vassalid,masterid". Separator is tab if the
+// first line has one and comma otherwise. Fields may be quoted with " and then contain separators
+// and doubled quotes. A first line is skipped as a header only when its fields are the column names
+// above, compared without case and underscores and with "townid", "vassal" and "master" also allowed.
+// Any other first line is a record like the rest.
+class TownFileLoader
+{
+public:
+    // 0 workers means one for every hardware thread.
+    explicit TownFileLoader(Datastructures& target, unsigned int workers = 0, std::size_t chunkBytes = 1 << 22);
+
+    // Loads all towns first and vassalships after them, so that masters always exist.
+    // vassalsPath may be empty when there are no vassalships.
+    LoadReport load(std::string const& townsPath, std::string const& vassalsPath = "");
+
+private:
+    struct Chunk;
+
+    Datastructures& target;
+    unsigned int workers;
+    std::size_t chunkBytes;
+
+    // Runs the whole pipeline for one file.
+    bool load_file(std::string const& path, bool vassals, LoadReport& report);
+
+    // Parses lines of a chunk to its records.
+    static void parse(Chunk& chunk, char separator, bool vassals);
 };
 
 #endif // DATASTRUCTURES_HH
@@ -0,0 +1,637 @@
+// Model_check.cc
+//
+// Runs random operations on Datastructures and on a naive model of the same towns and
+// compares every answer. The model keeps towns in a std::map by ID and answers queries the
+// obvious way, by going through all towns or walking masters one at a time. Towns at the
+// same distance or with the same name may be in any order, so orders are checked to be
+// sorted and to have exactly the towns of the model. Every CHECK_INTERVAL operations every
+// town is checked, and the towns are saved to a snapshot file and loaded to a second
+// Datastructures, which has to give the same answers.
+// Prints the first difference and exits with 1. Otherwise prints one JSON line:
+//   {"program":"prg2","seed":1,"operations":100000,"towns":500}
+// Build together with the datastructures, for example:
+//   g++ -std=c++17 -O2 -pthread prg2_model_check.cc prg2_datastructures.cc -o model_check
+// (with datastructures.hh available under that name like for the main program).
+// Usage: model_check [seed, default 1] [operations, default 100000] [snapshot file, default model_check.snapshot]
+
+#include "datastructures.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+// Towns are removed instead of added when there are this many, so the naive queries stay fast.
+std::size_t const MAX_TOWNS = 500;
+
+// Operations between checks of every town and snapshot file round trips.
+unsigned long const CHECK_INTERVAL = 2000;
+
+std::minstd_rand rand_engine;
+
+int random_in_range(int start, int end)
+{
+    return std::uniform_int_distribution<int>(start, end)(rand_engine);
+}
+
+// Short names made of the letters a, b and c, so that names are often the same or share a prefix.
+std::string random_name()
+{
+    std::string name(random_in_range(1, 8), 'a');
+    for(char& letter : name){
+        letter = 'a' + random_in_range(0, 2);
+    }
+    return name;
+}
+
+unsigned int edit_distance(std::string const& a, std::string const& b)
+{
+    std::vector<unsigned int> row(b.size() + 1);
+    for(std::size_t j = 0; j <= b.size(); ++j){
+        row[j] = j;
+    }
+    for(std::size_t i = 1; i <= a.size(); ++i){
+        unsigned int diagonal = row[0];
+        row[0] = i;
+        for(std::size_t j = 1; j <= b.size(); ++j){
+            unsigned int above = row[j];
+            row[j] = std::min({row[j] + 1, row[j - 1] + 1, diagonal + (a[i - 1] != b[j - 1])});
+            diagonal = above;
+        }
+    }
+    return row[b.size()];
+}
+
+// Snapshot files as described in prg2_datastructures.cc: a header with the number of towns at byte 16,
+// lengths of all IDs and names at 24 and 32 and the checksum at 40, then sections padded to 8 bytes.
+std::size_t const SNAPSHOT_HEADER_BYTES = 48;
+
+// Columns of 32-bit values in the order they are in the file.
+unsigned int const REALM_TAX_COLUMN = 3;
+unsigned int const HEIGHT_COLUMN = 5;
+unsigned int const DEEPEST_VASSAL_COLUMN = 6;
+
+std::uint64_t snapshot_field(std::string const& bytes, std::size_t position)
+{
+    std::uint64_t value;
+    std::memcpy(&value, bytes.data() + position, sizeof(value));
+    return value;
+}
+
+std::uint64_t padded(std::uint64_t bytes)
+{
+    return (bytes + 7) & ~std::uint64_t(7);
+}
+
+// Changes the value of one town in a column and writes a checksum that matches, like anyone
+// editing the file could.
+template <typename Change>
+void edit_snapshot(std::string& bytes, unsigned int column, std::uint64_t rank, Change change)
+{
+    std::uint64_t towns = snapshot_field(bytes, 16);
+    std::size_t position = SNAPSHOT_HEADER_BYTES + 2 * padded((towns + 1) * 8) + padded(snapshot_field(bytes, 24))
+            + padded(snapshot_field(bytes, 32)) + column * padded(towns * 4) + rank * 4;
+    std::uint32_t value;
+    std::memcpy(&value, bytes.data() + position, sizeof(value));
+    value = change(value);
+    std::memcpy(&bytes[position], &value, sizeof(value));
+
+    std::uint64_t checksum = 0xcbf29ce484222325ULL;
+    for(std::size_t i = SNAPSHOT_HEADER_BYTES; i < bytes.size(); i += 8){
+        checksum = (checksum ^ snapshot_field(bytes, i)) * 0x100000001b3ULL;
+        checksum ^= checksum >> 29;
+    }
+    std::memcpy(&bytes[40], &checksum, sizeof(checksum));
+}
+
+struct ModelTown
+{
+    std::string name;
+    int x;
+    int y;
+    int tax;
+    TownID master = NO_ID;
+    std::set<TownID> vassals = {};
+};
+
+// Towns by ID with every query done the slow and obvious way.
+class Model
+{
+public:
+    std::map<TownID, ModelTown> towns;
+
+    bool contains(TownID const& id) const
+    {
+        return towns.count(id) != 0;
+    }
+
+    int distance(TownID const& id, int x, int y) const
+    {
+        ModelTown const& town = towns.at(id);
+        return std::abs(town.x - x) + std::abs(town.y - y);
+    }
+
+    // Town itself and all its masters, or nothing if the town is not found.
+    std::vector<TownID> taxer_path(TownID const& id) const
+    {
+        std::vector<TownID> path;
+        for(TownID town = contains(id) ? id : NO_ID; town != NO_ID; town = towns.at(town).master){
+            path.push_back(town);
+        }
+        return path;
+    }
+
+    TownID common_master(TownID const& id1, TownID const& id2) const
+    {
+        std::vector<TownID> path = taxer_path(id1);
+        for(TownID const& town : taxer_path(id2)){
+            if(std::find(path.begin(), path.end(), town) != path.end()){
+                return town;
+            }
+        }
+        return NO_ID;
+    }
+
+    // Own tax and a tenth of the gross tax of every vassal.
+    int gross_tax(TownID const& id) const
+    {
+        int tax = towns.at(id).tax;
+        for(TownID const& vassal : towns.at(id).vassals){
+            tax += gross_tax(vassal) / 10;
+        }
+        return tax;
+    }
+
+    int net_tax(TownID const& id) const
+    {
+        int gross = gross_tax(id);
+        return towns.at(id).master == NO_ID ? gross : gross - gross / 10;
+    }
+
+    // Towns on the longest path down from the town, the town included.
+    std::size_t height(TownID const& id) const
+    {
+        std::size_t height = 0;
+        for(TownID const& vassal : towns.at(id).vassals){
+            height = std::max(height, this->height(vassal));
+        }
+        return height + 1;
+    }
+
+    // Datastructures expects the caller to keep vassalships a forest.
+    bool makes_cycle(TownID const& vassal, TownID const& master) const
+    {
+        std::vector<TownID> path = taxer_path(master);
+        return std::find(path.begin(), path.end(), vassal) != path.end();
+    }
+
+    void add_vassalship(TownID const& vassal, TownID const& master)
+    {
+        towns[vassal].master = master;
+        towns[master].vassals.insert(vassal);
+    }
+
+    // Vassals of a removed town become vassals of its master.
+    void remove(TownID const& id)
+    {
+        ModelTown town = towns.at(id);
+        if(town.master != NO_ID){
+            towns[town.master].vassals.erase(id);
+        }
+        for(TownID const& vassal : town.vassals){
+            towns[vassal].master = town.master;
+            if(town.master != NO_ID){
+                towns[town.master].vassals.insert(vassal);
+            }
+        }
+        towns.erase(id);
+    }
+
+    // IDs of towns whose name passes the test, in ID order.
+    template <typename Test>
+    std::vector<TownID> ids_with_name(Test test) const
+    {
+        std::vector<TownID> ids;
+        for(auto const& town : towns){
+            if(test(town.second.name)){
+                ids.push_back(town.first);
+            }
+        }
+        return ids;
+    }
+};
+
+class Checker
+{
+public:
+    Checker(unsigned int seed, std::string const& snapshotPath) : seed(seed), snapshotPath(snapshotPath)
+    {
+        // Small threshold makes even small batches go through the parallel merges.
+        if(seed % 2 == 1){
+            towns.set_merge_threads(seed % 4 + 1, 8);
+        }
+    }
+
+    void run(unsigned long operations)
+    {
+        for(step = 1; step <= operations; ++step){
+            int operation = random_in_range(0, 99);
+            if(operation < 25){
+                model.towns.size() < MAX_TOWNS ? add_town() : remove_town();
+            }
+            else if(operation < 27){
+                model.towns.size() < MAX_TOWNS ? add_towns() : remove_town();
+            }
+            else if(operation < 35){
+                change_town_name();
+            }
+            else if(operation < 50){
+                add_vassalship();
+            }
+            else if(operation < 58){
+                remove_town();
+            }
+            else if(operation < 70){
+                check_town(towns, random_id());
+            }
+            else if(operation < 80){
+                check_name_queries(towns, random_town_name());
+            }
+            else if(operation < 85){
+                check_common_master(towns);
+            }
+            else if(operation < 94){
+                check_distances(towns);
+            }
+            else {
+                check_orders(towns);
+            }
+
+            if(step % CHECK_INTERVAL == 0){
+                check_every_town(towns);
+                check_snapshot_file();
+            }
+        }
+        std::cout << "{\"program\":\"prg2\",\"seed\":" << seed << ",\"operations\":" << operations
+                  << ",\"towns\":" << model.towns.size() << "}" << std::endl;
+    }
+
+private:
+    unsigned int seed;
+    std::string snapshotPath;
+    Datastructures towns;
+    Model model;
+    unsigned long step = 0;
+    unsigned int nextId = 0;
+
+    void check(char const* what, bool ok) const
+    {
+        if(!ok){
+            std::cerr << "prg2 seed " << seed << " step " << step << ": " << what << " differs from the model" << std::endl;
+            std::exit(1);
+        }
+    }
+
+    // Mostly IDs of towns that exist, sometimes of towns that were removed or never added.
+    TownID random_id()
+    {
+        if(!model.towns.empty() && random_in_range(0, 3) != 0){
+            return std::next(model.towns.begin(), random_in_range(0, model.towns.size() - 1))->first;
+        }
+        return "t" + std::to_string(random_in_range(0, nextId + 2));
+    }
+
+    TownID new_id()
+    {
+        return random_in_range(0, 9) == 0 ? random_id() : "t" + std::to_string(nextId++);
+    }
+
+    std::string random_town_name()
+    {
+        if(!model.towns.empty() && random_in_range(0, 1) == 0){
+            return std::next(model.towns.begin(), random_in_range(0, model.towns.size() - 1))->second.name;
+        }
+        return random_name();
+    }
+
+    void add_town()
+    {
+        TownID id = new_id();
+        ModelTown town = {random_name(), random_in_range(-100, 100), random_in_range(-100, 100), random_in_range(0, 1000)};
+        bool added = !model.contains(id);
+        check("add_town", towns.add_town(id, town.name, town.x, town.y, town.tax) == added);
+        if(added){
+            model.towns[id] = town;
+        }
+    }
+
+    void add_towns()
+    {
+        std::vector<TownRecord> records(random_in_range(0, 200));
+        std::set<TownID> added;
+        std::vector<TownID> duplicates;
+        for(TownRecord& record : records){
+            record = {new_id(), random_name(), random_in_range(-100, 100), random_in_range(-100, 100), random_in_range(0, 1000)};
+            if(model.contains(record.id) || !added.insert(record.id).second){
+                duplicates.push_back(record.id);
+            }
+        }
+
+        AddTownsResult result = towns.add_towns(records);
+        check("add_towns", result.added == added.size() && result.duplicates == duplicates);
+        for(TownRecord const& record : records){
+            if(!model.contains(record.id)){
+                model.towns[record.id] = {record.name, record.x, record.y, record.tax};
+            }
+        }
+    }
+
+    void change_town_name()
+    {
+        TownID id = random_id();
+        std::string name = random_name();
+        bool found = model.contains(id);
+        check("change_town_name", towns.change_town_name(id, name) == found);
+        if(found){
+            model.towns[id].name = name;
+        }
+    }
+
+    void add_vassalship()
+    {
+        TownID vassal = random_id();
+        TownID master = random_id();
+        bool found = model.contains(vassal) && model.contains(master);
+        if(found && model.makes_cycle(vassal, master)){
+            return;
+        }
+        bool added = found && model.towns[vassal].master == NO_ID;
+        check("add_vassalship", towns.add_vassalship(vassal, master) == added);
+        if(added){
+            model.add_vassalship(vassal, master);
+        }
+    }
+
+    void remove_town()
+    {
+        TownID id = random_id();
+        bool found = model.contains(id);
+        check("remove_town", towns.remove_town(id) == found);
+        if(found){
+            model.remove(id);
+        }
+    }
+
+    // Everything that is asked with one ID.
+    void check_town(Datastructures& checked, TownID const& id)
+    {
+        auto town = model.towns.find(id);
+        if(town == model.towns.end()){
+            check("get_name", checked.get_name(id) == NO_NAME);
+            check("get_coordinates", checked.get_coordinates(id) == std::make_pair(NO_VALUE, NO_VALUE));
+            check("get_tax", checked.get_tax(id) == NO_VALUE);
+            check("get_vassals", checked.get_vassals(id) == std::vector<TownID>{NO_ID});
+            check("taxer_path", checked.taxer_path(id).empty());
+            check("nth_master", checked.nth_master(id, 0) == NO_ID);
+            check("vassal_depth", checked.vassal_depth(id) == NO_VALUE);
+            check("longest_vassal_path", checked.longest_vassal_path(id).empty());
+            check("total_net_tax", checked.total_net_tax(id) == NO_VALUE);
+            return;
+        }
+
+        ModelTown const& expected = town->second;
+        std::vector<TownID> path = model.taxer_path(id);
+        check("get_name", checked.get_name(id) == expected.name);
+        check("get_coordinates", checked.get_coordinates(id) == std::make_pair(expected.x, expected.y));
+        check("get_tax", checked.get_tax(id) == expected.tax);
+        check("get_vassals", checked.get_vassals(id) == std::vector<TownID>(expected.vassals.begin(), expected.vassals.end()));
+        check("taxer_path", checked.taxer_path(id) == path);
+        for(unsigned int k = 0; k <= path.size(); ++k){
+            check("nth_master", checked.nth_master(id, k) == (k < path.size() ? path[k] : NO_ID));
+        }
+        check("vassal_depth", checked.vassal_depth(id) == int(path.size()) - 1);
+        check("total_net_tax", checked.total_net_tax(id) == model.net_tax(id));
+
+        // Any of the longest paths will do.
+        std::vector<TownID> longest = checked.longest_vassal_path(id);
+        check("longest_vassal_path", longest.size() == model.height(id) && longest.front() == id);
+        for(std::size_t i = 1; i < longest.size(); ++i){
+            check("longest_vassal_path", model.contains(longest[i]) && model.towns[longest[i]].master == longest[i - 1]);
+        }
+    }
+
+    void check_common_master(Datastructures& checked)
+    {
+        TownID id1 = random_id();
+        TownID id2 = random_id();
+        check("common_master", checked.common_master(id1, id2) == model.common_master(id1, id2));
+    }
+
+    // IDs must be the expected towns in alphabetical order of their names.
+    void check_alphabetical(char const* what, std::vector<TownID> ids, std::vector<TownID> const& expected)
+    {
+        for(std::size_t i = 1; i < ids.size(); ++i){
+            check(what, model.contains(ids[i - 1]) && model.contains(ids[i])
+                        && model.towns[ids[i - 1]].name <= model.towns[ids[i]].name);
+        }
+        std::sort(ids.begin(), ids.end());
+        check(what, ids == expected);
+    }
+
+    void check_name_queries(Datastructures& checked, std::string const& name)
+    {
+        check("find_towns", checked.find_towns(name) == model.ids_with_name([&name](std::string const& other){
+            return other == name;
+        }));
+
+        std::string prefix = name.substr(0, random_in_range(0, name.size()));
+        check_alphabetical("find_towns_by_prefix", checked.find_towns_by_prefix(prefix),
+                           model.ids_with_name([&prefix](std::string const& other){
+            return other.compare(0, prefix.size(), prefix) == 0;
+        }));
+
+        std::string last = random_name();
+        check_alphabetical("towns_in_name_range", checked.towns_in_name_range(prefix, last),
+                           model.ids_with_name([&prefix, &last](std::string const& other){
+            return prefix <= other && other < last;
+        }));
+
+        unsigned int maxEdits = random_in_range(0, 3);
+        check_alphabetical("find_towns_fuzzy", checked.find_towns_fuzzy(name, maxEdits),
+                           model.ids_with_name([&name, maxEdits](std::string const& other){
+            return edit_distance(name, other) <= maxEdits;
+        }));
+    }
+
+    // IDs must be all towns in order of distance from (x, y).
+    void check_by_distance(char const* what, std::vector<TownID> ids, int x, int y)
+    {
+        check(what, ids.size() == model.towns.size());
+        for(std::size_t i = 1; i < ids.size(); ++i){
+            check(what, model.contains(ids[i - 1]) && model.contains(ids[i])
+                        && model.distance(ids[i - 1], x, y) <= model.distance(ids[i], x, y));
+        }
+        std::sort(ids.begin(), ids.end());
+        check(what, std::adjacent_find(ids.begin(), ids.end()) == ids.end());
+    }
+
+    void check_distances(Datastructures& checked)
+    {
+        std::vector<int> distances;
+        for(auto const& town : model.towns){
+            distances.push_back(model.distance(town.first, 0, 0));
+        }
+        std::sort(distances.begin(), distances.end());
+
+        auto distance_is = [this](TownID const& id, int distance){
+            return model.contains(id) && model.distance(id, 0, 0) == distance;
+        };
+        if(distances.empty()){
+            check("min_distance", checked.min_distance() == NO_ID);
+            check("max_distance", checked.max_distance() == NO_ID);
+        }
+        else {
+            check("min_distance", distance_is(checked.min_distance(), distances.front()));
+            check("max_distance", distance_is(checked.max_distance(), distances.back()));
+        }
+        unsigned int n = random_in_range(0, distances.size() + 1);
+        TownID nth = checked.nth_distance(n);
+        check("nth_distance", n == 0 || n > distances.size() ? nth == NO_ID : distance_is(nth, distances[n - 1]));
+
+        int x = random_in_range(-120, 120);
+        int y = random_in_range(-120, 120);
+        check_by_distance("towns_distance_increasing_from", checked.towns_distance_increasing_from(x, y), x, y);
+
+        unsigned int k = random_in_range(0, 20);
+        std::vector<TownID> nearest = checked.nearest_towns(x, y, k);
+        std::vector<TownID> all = checked.towns_distance_increasing_from(x, y);
+        check("nearest_towns", nearest.size() == std::min<std::size_t>(k, all.size()));
+        for(std::size_t i = 0; i < nearest.size(); ++i){
+            check("nearest_towns", model.contains(nearest[i]) && model.distance(nearest[i], x, y) == model.distance(all[i], x, y));
+        }
+    }
+
+    void check_orders(Datastructures& checked)
+    {
+        std::vector<TownID> all;
+        for(auto const& town : model.towns){
+            all.push_back(town.first);
+        }
+        std::vector<TownID> alphabetical = checked.towns_alphabetically();
+        check_alphabetical("towns_alphabetically", alphabetical, all);
+        TownIDRange view = checked.towns_alphabetically_view();
+        check("towns_alphabetically_view", std::vector<TownID>(view.begin(), view.end()) == alphabetical);
+
+        std::vector<TownID> unordered = checked.all_towns();
+        std::sort(unordered.begin(), unordered.end());
+        check("all_towns", unordered == all);
+
+        std::vector<TownID> byDistance = checked.towns_distance_increasing();
+        check_by_distance("towns_distance_increasing", byDistance, 0, 0);
+        std::vector<TownID> visited;
+        checked.for_each_town_distance_increasing([&visited](TownID const& id){
+            visited.push_back(id);
+        });
+        check("for_each_town_distance_increasing", visited == byDistance);
+        check("size", checked.size() == model.towns.size());
+    }
+
+    void check_every_town(Datastructures& checked)
+    {
+        check_orders(checked);
+        check_distances(checked);
+        for(auto const& town : model.towns){
+            check_town(checked, town.first);
+        }
+    }
+
+    // Saved towns loaded to another Datastructures must be the same towns in the same orders.
+    // Files with one bit flipped, or with a cached vassal column edited and the checksum fixed to
+    // match, must be refused without changing anything.
+    void check_snapshot_file()
+    {
+        check("save_snapshot", towns.save_snapshot(snapshotPath));
+        Datastructures loaded;
+        check("load_snapshot", loaded.load_snapshot(snapshotPath));
+        check_every_town(loaded);
+        check("load_snapshot", loaded.towns_alphabetically() == towns.towns_alphabetically());
+        check("load_snapshot", loaded.towns_distance_increasing() == towns.towns_distance_increasing());
+
+        std::string bytes;
+        {
+            std::ifstream in(snapshotPath, std::ios::binary);
+            bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+        // Towns are in alphabetical order in the file.
+        std::vector<TownID> ranks = towns.towns_alphabetically();
+        if(!ranks.empty()){
+            std::uint64_t rank = random_in_range(0, ranks.size() - 1);
+            auto one_more = [](std::uint32_t value){
+                return value + 1;
+            };
+            std::string edited = bytes;
+            edit_snapshot(edited, REALM_TAX_COLUMN, rank, one_more);
+            check_refused("load_snapshot with an edited realm tax", loaded, edited);
+            edited = bytes;
+            edit_snapshot(edited, HEIGHT_COLUMN, rank, one_more);
+            check_refused("load_snapshot with an edited height", loaded, edited);
+
+            // Deepest vassals of a town and its master pointing at each other would send
+            // longest_vassal_path around in a loop.
+            for(std::uint64_t i = 0; i < ranks.size(); ++i){
+                std::uint64_t vassal = (rank + i) % ranks.size();
+                TownID const& master = model.towns[ranks[vassal]].master;
+                if(master != NO_ID){
+                    std::uint64_t masterRank = std::find(ranks.begin(), ranks.end(), master) - ranks.begin();
+                    edited = bytes;
+                    edit_snapshot(edited, DEEPEST_VASSAL_COLUMN, masterRank, [vassal](std::uint32_t){
+                        return vassal;
+                    });
+                    edit_snapshot(edited, DEEPEST_VASSAL_COLUMN, vassal, [masterRank](std::uint32_t){
+                        return masterRank;
+                    });
+                    check_refused("load_snapshot with deepest vassals in a loop", loaded, edited);
+                    break;
+                }
+            }
+        }
+        if(!bytes.empty()){
+            bytes[random_in_range(0, bytes.size() - 1)] ^= char(1 << random_in_range(0, 7));
+            check_refused("load_snapshot of a damaged file", loaded, bytes);
+        }
+        check_every_town(loaded);
+        std::remove(snapshotPath.c_str());
+    }
+
+    void check_refused(char const* what, Datastructures& loaded, std::string const& bytes)
+    {
+        std::ofstream(snapshotPath, std::ios::binary | std::ios::trunc) << bytes;
+        check(what, !loaded.load_snapshot(snapshotPath));
+    }
+};
+
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int seed = argc > 1 ? std::stoul(argv[1]) : 1;
+    unsigned long operations = argc > 2 ? std::stoul(argv[2]) : 100000;
+    std::string snapshotPath = argc > 3 ? argv[3] : "model_check.snapshot";
+    rand_engine.seed(seed);
+
+    Checker checker(seed, snapshotPath);
+    checker.run(operations);
+    return 0;
+}